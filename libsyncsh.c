@@ -0,0 +1,5906 @@
+/*
+ * libsyncsh - the engine of "syncsh": capturing a job's output,
+ * synchronizing with other jobs and replaying the result atomically.
+ * See libsyncsh.h for the API and the README for the environment
+ * variables it honours. Like syncsh, this is written to the POSIX
+ * API with some optional Linux extras.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <sys/prctl.h>
+#endif
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SCAN_X86
+#endif
+
+#include "libsyncsh.h"
+
+#define PFX			"SYNCSH_"
+
+#define STREAM_OK(strm)		((fcntl(fileno((strm)), F_GETFD) != -1) || (errno != EBADF))
+
+#ifdef EINTR
+#define EINTR_CHECK(lhs,fcn)	while (((lhs)=fcn) == -1 && errno == EINTR)
+#else
+#define EINTR_CHECK(lhs,fcn)	((lhs) = (fcn))
+#endif
+
+#define is_absolute(path)	(*path == '/')
+
+static const char *prog = "syncsh";
+
+static void
+syserr_(const char *f, int l, int code, const char *ex)
+{
+    char *type = code ? "Error" : "Warning";
+    char *msg = strerror(errno);
+
+    if (ex) {
+	fprintf(stderr, "%s:%d: %s: %s: %s: %s\n", f, l, prog, type, ex, msg);
+    } else {
+	fprintf(stderr, "%s:%d: %s: %s: %s\n", f, l, prog, type, msg);
+    }
+
+    if (code)
+	exit(code);
+}
+
+#define syserr(code, ...)  syserr_(__FILE__, __LINE__, code, __VA_ARGS__);
+
+static uint16_t
+str_hash(char *str, unsigned len)
+{
+    uint16_t hash = 0;
+    uint16_t i = 0;
+
+    for (i = 0; i < len; str++, i++) {
+	hash = (*str) + (hash << 6) + (hash << 16) - hash;
+    }
+
+    return hash >> 1;
+}
+
+static void
+pump_from_tmp_fd(int from_fd, int to_fd)
+{
+    ssize_t nleft, nwrite;
+    char buffer[8192];
+
+    if (lseek(from_fd, 0, SEEK_SET) == -1)
+	perror("lseek()");
+
+    while (1) {
+	char *p = buffer;
+
+	EINTR_CHECK(nleft, read(from_fd, buffer, sizeof(buffer)));
+	if (nleft < 0)
+	    perror("read()");
+	if (nleft <= 0)
+	    break;
+
+	while (nleft > 0) {
+	    EINTR_CHECK(nwrite, write(to_fd, p, nleft));
+	    if (nwrite < 0) {
+		perror("write()");
+		return;
+	    }
+
+	    nleft -= nwrite;
+	    p += nwrite;
+	}
+    }
+}
+
+/*
+ * Recipe classes. SYNCSH_CLASSES may name a file of rules, one per
+ * line, of the form
+ *
+ *     <name> match='<regexp>' [<attribute>=<value> ...]
+ *
+ * The first rule whose (extended) regexp matches the recipe text
+ * gives the recipe its class. Values may be single-quoted. Sizes
+ * may carry a K, M or G suffix.
+ */
+struct class {
+    char *name;
+    int cache;			/* memoize this class's output */
+    char *inputs;		/* comma-separated globs hashed into the key */
+    char *outputs;		/* comma-separated globs restored on a hit */
+    char *env;			/* comma-separated variables in the key */
+    int nice;			/* scheduling priority, or INT_MIN */
+    int ioclass, iolevel;	/* I/O priority, or -1 */
+    long long as, nofile;	/* resource limits, or 0 */
+    int oom;			/* oom_score_adj, or INT_MIN */
+    long long memhigh;		/* cgroup memory.high, or 0 */
+    int cpuweight;		/* cgroup cpu.weight, or 0 */
+    int max;			/* concurrency cap, or 0 */
+};
+
+static long long
+parse_size(const char *str)
+{
+    char *end;
+    long long n = strtoll(str, &end, 10);
+
+    if (end == str || n < 0)
+	return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'G':
+	n <<= 10;
+	/* FALLTHROUGH */
+    case 'M':
+	n <<= 10;
+	/* FALLTHROUGH */
+    case 'K':
+	n <<= 10;
+	end++;
+	break;
+    }
+
+    return *end ? -1 : n;
+}
+
+/*
+ * The class's concurrency cap: its max attribute, overridden by
+ * any "<name>=<n>" entry in the comma-separated SYNCSH_CAPS.
+ */
+static int
+class_cap(const struct class *c)
+{
+    size_t len = strlen(c->name);
+    char *p;
+    int n = c->max;
+
+    for (p = getenv(PFX "CAPS"); p && *p; p += strcspn(p, ",")) {
+	if (*p == ',')
+	    p++;
+	if (!strncmp(p, c->name, len) && p[len] == '=')
+	    n = atoi(p + len + 1);
+    }
+
+    return n;
+}
+
+/* Parse "idle", "be[:<level>]" or "rt[:<level>]" as in ionice(1). */
+static int
+parse_ionice(const char *str, int *ioclass, int *iolevel)
+{
+    static const char *names[] = { "none", "rt", "be", "idle" };
+    size_t len = strcspn(str, ":");
+    int i;
+
+    for (i = 1; i < 4; i++)
+	if (strlen(names[i]) == len && !strncmp(str, names[i], len))
+	    break;
+    if (i == 4)
+	return -1;
+    *ioclass = i;
+    *iolevel = str[len] ? atoi(str + len + 1) : 4;
+
+    return *iolevel >= 0 && *iolevel <= 7 ? 0 : -1;
+}
+
+/* Split off the next whitespace-delimited token, removing quotes. */
+static char *
+class_token(char **pp)
+{
+    char *p = *pp, *tok, *out;
+
+    while (isspace((unsigned char)*p))
+	p++;
+    if (!*p || *p == '#')
+	return NULL;
+    for (tok = out = p; *p && !isspace((unsigned char)*p); p++) {
+	if (*p == '\'') {
+	    for (p++; *p && *p != '\''; p++)
+		*out++ = *p;
+	    if (!*p)
+		break;
+	} else {
+	    *out++ = *p;
+	}
+    }
+    if (*p)
+	p++;
+    *out = '\0';
+    *pp = p;
+
+    return tok;
+}
+
+static struct class *
+classify(const char *file, const char *text)
+{
+    struct class c, *cp;
+    char line[4096];
+    char *p, *tok, *val, *bad = NULL;
+    FILE *fp;
+    int lineno = 0, found = 0;
+
+    if (!is_absolute(file)) {
+	fprintf(stderr, "%s: Error: '%s' not an absolute path\n", prog, file);
+	return NULL;
+    }
+    if (!(fp = fopen(file, "r"))) {
+	syserr(0, file);
+	return NULL;
+    }
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+	lineno++;
+	line[strcspn(line, "\n")] = '\0';
+	p = line;
+	if (!(tok = class_token(&p)))
+	    continue;
+	memset(&c, 0, sizeof(c));
+	c.nice = c.oom = INT_MIN;
+	c.ioclass = -1;
+	c.name = tok;
+	while ((tok = class_token(&p))) {
+	    if (!(val = strchr(tok, '='))) {
+		fprintf(stderr, "%s:%d: %s: Error: expected attribute=value\n",
+			file, lineno, prog);
+		continue;
+	    }
+	    *val++ = '\0';
+	    if (!strcmp(tok, "match")) {
+		regex_t re;
+
+		if (regcomp(&re, val, REG_EXTENDED | REG_NOSUB)) {
+		    fprintf(stderr, "%s:%d: %s: Error: bad regular expression '%s'\n",
+			    file, lineno, prog, val);
+		    break;
+		}
+		found = !regexec(&re, text, 0, NULL, 0);
+		regfree(&re);
+		if (!found)
+		    break;
+	    } else if (!strcmp(tok, "cache")) {
+		c.cache = strcmp(val, "0") && strcmp(val, "no");
+	    } else if (!strcmp(tok, "inputs")) {
+		c.inputs = val;
+	    } else if (!strcmp(tok, "outputs")) {
+		c.outputs = val;
+	    } else if (!strcmp(tok, "env")) {
+		c.env = val;
+	    } else if (!strcmp(tok, "nice")) {
+		c.nice = atoi(val);
+	    } else if (!strcmp(tok, "ionice")) {
+		if (parse_ionice(val, &c.ioclass, &c.iolevel))
+		    bad = tok;
+	    } else if (!strcmp(tok, "as")) {
+		if ((c.as = parse_size(val)) <= 0)
+		    bad = tok;
+	    } else if (!strcmp(tok, "nofile")) {
+		if ((c.nofile = parse_size(val)) <= 0)
+		    bad = tok;
+	    } else if (!strcmp(tok, "oom")) {
+		c.oom = atoi(val);
+	    } else if (!strcmp(tok, "memhigh")) {
+		if ((c.memhigh = parse_size(val)) <= 0)
+		    bad = tok;
+	    } else if (!strcmp(tok, "max")) {
+		if ((c.max = atoi(val)) <= 0)
+		    bad = tok;
+	    } else if (!strcmp(tok, "cpuweight")) {
+		c.cpuweight = atoi(val);
+		if (c.cpuweight < 1 || c.cpuweight > 10000)
+		    bad = tok;
+	    } else {
+		fprintf(stderr, "%s:%d: %s: Error: unknown attribute '%s'\n",
+			file, lineno, prog, tok);
+	    }
+	    if (bad) {
+		fprintf(stderr, "%s:%d: %s: Error: bad value for '%s'\n",
+			file, lineno, prog, bad);
+		bad = NULL;
+	    }
+	}
+    }
+    fclose(fp);
+
+    if (!found)
+	return NULL;
+
+    /* The line buffer is about to go away. */
+    if (!(cp = malloc(sizeof(*cp))))
+	return NULL;
+    *cp = c;
+    cp->name = strdup(c.name);
+    cp->inputs = c.inputs ? strdup(c.inputs) : NULL;
+    cp->outputs = c.outputs ? strdup(c.outputs) : NULL;
+    cp->env = c.env ? strdup(c.env) : NULL;
+
+    return cp;
+}
+
+static void
+class_free(struct class *c)
+{
+    free(c->name);
+    free(c->inputs);
+    free(c->outputs);
+    free(c->env);
+    free(c);
+}
+
+static void
+class_rlimit(int resource, long long value, const char *name)
+{
+    struct rlimit rl;
+
+    if (getrlimit(resource, &rl) == -1)
+	return;
+    rl.rlim_cur = value;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+	rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(resource, &rl) == -1)
+	syserr(0, name);
+}
+
+/*
+ * Apply a class's execution attributes. This runs in the child
+ * between vfork() and exec so everything here must affect only
+ * the calling process. Failures are reported but not fatal.
+ */
+static void
+class_apply(const struct class *c)
+{
+    if (c->nice != INT_MIN && setpriority(PRIO_PROCESS, 0, c->nice) == -1)
+	syserr(0, "setpriority");
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (c->ioclass > 0 && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */ ,
+				  0, c->ioclass << 13 | c->iolevel) == -1)
+	syserr(0, "ioprio_set");
+#endif
+    if (c->as)
+	class_rlimit(RLIMIT_AS, c->as, "RLIMIT_AS");
+    if (c->nofile)
+	class_rlimit(RLIMIT_NOFILE, c->nofile, "RLIMIT_NOFILE");
+#ifdef __linux__
+    if (c->oom != INT_MIN) {
+	char buf[16];
+	int fd, n;
+
+	n = snprintf(buf, sizeof(buf), "%d\n", c->oom);
+	if ((fd = open("/proc/self/oom_score_adj", O_WRONLY)) == -1
+	    || write(fd, buf, n) != n)
+	    syserr(0, "oom_score_adj");
+	if (fd != -1)
+	    close(fd);
+    }
+#endif
+}
+
+/*
+ * Per-recipe statistics. When SYNCSH_STATS names a directory each
+ * recipe appends one tab-separated "key=value" record line to a
+ * shard file chosen by the CPU it happens to be running on. The
+ * record goes out in a single write() to an O_APPEND descriptor
+ * and is kept under PIPE_BUF bytes so no locking is required;
+ * sharding just keeps concurrent appenders off the same inode.
+ * The records are aggregated later by "syncsh metrics".
+ */
+struct stats {
+    int64_t start, end;		/* wall clock, usec */
+    int64_t lockwait;		/* waiting for the output lock */
+    int64_t lockhold;		/* holding the output lock */
+    int64_t serwait;		/* waiting for a SERIALIZE lock, or -1 */
+    int64_t capwait;		/* waiting under a class cap, or -1 */
+    int64_t outbytes, errbytes;	/* captured output */
+    int64_t held;		/* of which kept after compression, or -1 */
+    int64_t budgetpeak;		/* build-wide capture memory peak, or -1 */
+    long spills;		/* captures which had to move to disk */
+    int cache;			/* 0 = not cached, 1 = miss, 2 = hit */
+    int coalesced;		/* 0 = no, 1 = ran it, 2 = replayed it */
+    int spooled;		/* 0 = no, 1 = lock timed out, 2 = write did */
+    int summarized;		/* terminal got a summary, the tee the output */
+    int64_t admitwait;		/* waiting for SYNCSH_ADMIT, or -1 */
+    int64_t admitted;		/* memory it reserved */
+    int cgroup;			/* ran in its own cgroup */
+    long long cgmem, cgcpu;	/* cgroup memory.peak and cpu usage_usec */
+    long long cgread, cgwrite;	/* cgroup io.stat bytes */
+    int exitcode;
+    struct rusage ru;
+};
+
+static int64_t
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int64_t
+syncsh_now_us(void)
+{
+    return now_us();
+}
+
+struct proc;
+struct arena_reader;
+
+/*
+ * Everything belonging to one job. What used to be syncsh's globals
+ * lives here so a driver may have any number of jobs in flight.
+ */
+struct syncsh_job {
+    char *recipe;
+    char *shell;
+    int flags;
+    int syncfd;
+    int ownsync;		/* syncfd was opened by us */
+    FILE *out, *err;		/* capture files, or NULL if serialized */
+    struct arena_reader *rd;	/* compressed capture, or NULL */
+    struct class *cls;
+    struct stats stats;
+    char *cachedir;
+    char cachekey[65];
+    int hit;			/* result was replayed */
+    struct flock fl, capfl;
+    struct flock *sem;		/* SERIALIZE or output lock held */
+    struct flock *capsem;	/* class cap held */
+    int coalesce_slot;
+    pid_t child;
+    int status;
+    int evfd;			/* SYNCSH_EVENTS socket, or -1 */
+    uint32_t evseq, evjob;
+    int evroom;			/* send buffer output events may use */
+    int evtrunc;		/* output events were dropped */
+    int lockfd;			/* SYNCSH_LOCKD connection holding the lock, or -1 */
+    int status_slot;		/* SYNCSH_STATUS slot, or -1 */
+    int admit_slot;		/* SYNCSH_ADMIT reservation, or -1 */
+    int lines;			/* SYNCSH_LINES: output went out as it came */
+#ifdef __linux__
+    cpu_set_t pinset;
+    int pin_slot;
+    char cgdir[PATH_MAX];
+    int procs_on;
+    sigset_t sigmask;
+    struct proc *procs;
+    int nprocs;
+#endif
+};
+
+/*
+ * fcntl() locks belong to the process, so threads of a driver running
+ * jobs concurrently are kept apart by these as well.
+ */
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t attach_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Take a lock byte, giving up at 'deadline' (usec, 0 for never) with
+ * errno set to ETIMEDOUT. There's no F_SETLKW with a timeout, so a
+ * bounded wait polls instead, backing off to 20ms between tries.
+ */
+static struct flock *
+acquire_semaphore(struct syncsh_job *j, struct flock *fl, uint16_t off,
+		  int64_t deadline)
+{
+    useconds_t nap = 500;
+    int rc;
+
+    fl->l_type = F_WRLCK;
+    fl->l_whence = SEEK_SET;
+    fl->l_pid = getpid();
+    fl->l_start = off;		/* lock just one byte */
+    fl->l_len = 1;
+    while ((rc = fcntl(j->syncfd, deadline ? F_SETLK : F_SETLKW, fl)) == -1
+	   && deadline && (errno == EACCES || errno == EAGAIN || errno == EINTR)) {
+	if (now_us() >= deadline) {
+	    errno = ETIMEDOUT;
+	    return NULL;
+	}
+	usleep(nap);
+	if (nap < 20000)
+	    nap *= 2;
+    }
+    if (rc != -1) {
+	if (getenv(PFX "DEBUG"))
+	    fprintf(stderr, "%s: locked byte %d.%u for '%s'\n", prog,
+		    j->syncfd, off, j->recipe);
+	return fl;
+    }
+    perror("fcntl()");
+    return NULL;
+}
+
+static void
+release_semaphore(struct syncsh_job *j, struct flock *fl)
+{
+    fl->l_type = F_UNLCK;
+    if (fcntl(j->syncfd, F_SETLKW, fl) == -1)
+	perror("fcntl()");
+}
+
+/*
+ * A counting semaphore of 'n' lock bytes starting at 'base': take
+ * whichever byte is free first, polling them all with a backoff as
+ * fcntl() can only wait for one.
+ */
+static struct flock *
+acquire_counting_semaphore(struct syncsh_job *j, struct flock *fl,
+			   off_t base, int n)
+{
+    useconds_t nap = 500;
+    int i;
+
+    fl->l_type = F_WRLCK;
+    fl->l_whence = SEEK_SET;
+    fl->l_pid = getpid();
+    fl->l_len = 1;
+    for (;;) {
+	for (i = 0; i < n; i++) {
+	    fl->l_start = base + i;
+	    if (fcntl(j->syncfd, F_SETLK, fl) != -1)
+		return fl;
+	    if (errno != EACCES && errno != EAGAIN && errno != EINTR) {
+		perror("fcntl()");
+		return NULL;
+	    }
+	}
+	usleep(nap);
+	if (nap < 20000)
+	    nap *= 2;
+    }
+}
+
+static uint64_t
+str_hash64(const char *str, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+    while (len--) {
+	hash ^= (unsigned char)*str++;
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * The scanner for captured output. Splitting into lines, spotting
+ * escape sequences and quoting all look for the same few bytes:
+ * newlines, ESC, the other control characters, DEL, '"' and '\\'.
+ * syncsh_scan_lines() classifies every byte of a block at once, 32 at
+ * a time with AVX2, 16 with SSE2 or 8 with plain 64-bit arithmetic,
+ * and turns the bitmasks into lines and their flags without going
+ * back over anything. The kernel is picked on first use from what the
+ * cpu has, unless SYNCSH_SCAN names one. Ordinary text goes by at
+ * several GB/s, well below the cost of copying it.
+ */
+#define SCAN_ONES	0x0101010101010101ULL
+#define SCAN_HIGHS	0x8080808080808080ULL
+
+struct scan {
+    const char *p;
+    size_t len;
+    size_t start;		/* of the line being scanned */
+    unsigned flags;		/* of the line so far */
+    struct syncsh_line *line;
+    size_t n, max;
+};
+
+/* The line ends before 'end'. Returns 1 once there's no room for more. */
+static int
+scan_end(struct scan *s, size_t end)
+{
+    s->line[s->n].len = end - s->start;
+    s->line[s->n].flags = s->flags;
+    s->start = end;
+    s->flags = 0;
+
+    return ++s->n == s->max;
+}
+
+/* Newline, ESC and other special bytes of a block at 'base', as bits. */
+static int
+scan_bits(struct scan *s, size_t base, uint64_t nl, uint64_t esc, uint64_t quote)
+{
+    uint64_t upto;
+
+    while (nl) {
+	upto = (nl & -nl) * 2 - 1;	/* bits up to the first newline */
+	s->flags |= (esc & upto ? SYNCSH_SCAN_ESC : 0)
+	    | (quote & upto ? SYNCSH_SCAN_QUOTE : 0);
+	if (scan_end(s, base + __builtin_ctzll(nl) + 1))
+	    return 1;
+	nl &= ~upto;
+	esc &= ~upto;
+	quote &= ~upto;
+    }
+    s->flags |= (esc ? SYNCSH_SCAN_ESC : 0) | (quote ? SYNCSH_SCAN_QUOTE : 0);
+
+    return 0;
+}
+
+static int
+scan_byte(struct scan *s, size_t i)
+{
+    unsigned char c = s->p[i];
+
+    if (c == '\n')
+	return scan_end(s, i + 1);
+    if (c == '\033')
+	s->flags |= SYNCSH_SCAN_ESC;
+    else if (c < 0x20 || c == '"' || c == '\\' || c == 0x7f)
+	s->flags |= SYNCSH_SCAN_QUOTE;
+
+    return 0;
+}
+
+static void
+scan_portable(struct scan *s, size_t i)
+{
+    uint64_t x, q, b, d;
+    size_t k;
+
+    /*
+     * A word is let through whole unless it may hold a special byte:
+     * one below 0x20, or one equal to '"', '\\' or DEL. The tests can
+     * only err the cautious way, so a word they flag is looked at byte
+     * by byte.
+     */
+    for (; i + 8 <= s->len; i += 8) {
+	memcpy(&x, s->p + i, 8);
+	q = x ^ (SCAN_ONES * '"');
+	b = x ^ (SCAN_ONES * '\\');
+	d = x ^ (SCAN_ONES * 0x7f);
+	if ((((x - SCAN_ONES * 0x20) & ~x) | ((q - SCAN_ONES) & ~q)
+	     | ((b - SCAN_ONES) & ~b) | ((d - SCAN_ONES) & ~d)) & SCAN_HIGHS)
+	    for (k = 0; k < 8; k++)
+		if (scan_byte(s, i + k))
+		    return;
+    }
+    for (; i < s->len; i++)
+	if (scan_byte(s, i))
+	    return;
+}
+
+#ifdef HAVE_SCAN_X86
+__attribute__((target("sse2")))
+static void
+scan_sse2(struct scan *s, size_t i)
+{
+    const __m128i ctl = _mm_set1_epi8(0x1f), nl = _mm_set1_epi8('\n');
+    const __m128i esc = _mm_set1_epi8('\033'), quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\'), del = _mm_set1_epi8(0x7f);
+    __m128i v, m;
+    unsigned mn, me, mq;
+
+    for (; i + 16 <= s->len; i += 16) {
+	v = _mm_loadu_si128((const __m128i *)(s->p + i));
+	m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+			 _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+				      _mm_or_si128(_mm_cmpeq_epi8(v, bslash),
+						   _mm_cmpeq_epi8(v, del))));
+	if (!(mq = _mm_movemask_epi8(m)))
+	    continue;
+	mn = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+	me = _mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+	if (scan_bits(s, i, mn, me, mq & ~(mn | me)))
+	    return;
+    }
+    scan_portable(s, i);
+}
+
+__attribute__((target("avx2")))
+static void
+scan_avx2(struct scan *s, size_t i)
+{
+    const __m256i ctl = _mm256_set1_epi8(0x1f), nl = _mm256_set1_epi8('\n');
+    const __m256i esc = _mm256_set1_epi8('\033'), quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\'), del = _mm256_set1_epi8(0x7f);
+    __m256i v, m;
+    unsigned mn, me, mq;
+
+    for (; i + 32 <= s->len; i += 32) {
+	v = _mm256_loadu_si256((const __m256i *)(s->p + i));
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+			    _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+					    _mm256_or_si256(_mm256_cmpeq_epi8(v, bslash),
+							    _mm256_cmpeq_epi8(v, del))));
+	if (!(mq = _mm256_movemask_epi8(m)))
+	    continue;
+	mn = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+	me = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, esc));
+	if (scan_bits(s, i, mn, me, mq & ~(mn | me)))
+	    return;
+    }
+    scan_sse2(s, i);
+}
+#endif
+
+typedef void scan_fn(struct scan *s, size_t i);
+
+static scan_fn *scan_kernel;
+
+static scan_fn *
+scan_pick(void)
+{
+    scan_fn *fn = scan_portable;
+    char *want = getenv(PFX "SCAN");
+
+#ifdef HAVE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2") && (!want || strcmp(want, "portable")))
+	fn = scan_sse2;
+    if (__builtin_cpu_supports("avx2") && (!want || !strcmp(want, "avx2")))
+	fn = scan_avx2;
+    if (want && !strcmp(want, "avx2") && fn != scan_avx2)
+	fprintf(stderr, "%s: Warning: no avx2 here, scanning with %s\n", prog,
+		fn == scan_sse2 ? "sse2" : "portable");
+#else
+    if (want && strcmp(want, "portable"))
+	fprintf(stderr, "%s: Warning: no %s here, scanning with portable\n", prog, want);
+#endif
+    __atomic_store_n(&scan_kernel, fn, __ATOMIC_RELAXED);
+
+    return fn;
+}
+
+size_t
+syncsh_scan_lines(const char *p, size_t len, struct syncsh_line *line, size_t max)
+{
+    scan_fn *fn = __atomic_load_n(&scan_kernel, __ATOMIC_RELAXED);
+    struct scan s = { p, len, 0, 0, line, 0, max };
+
+    if (!max)
+	return 0;
+    (fn ? fn : scan_pick())(&s, 0);
+    if (s.n < max && s.start < len)
+	scan_end(&s, len);
+
+    return s.n;
+}
+
+const char *
+syncsh_scan_kernel(void)
+{
+    scan_fn *fn = __atomic_load_n(&scan_kernel, __ATOMIC_RELAXED);
+
+    if (!fn)
+	fn = scan_pick();
+#ifdef HAVE_SCAN_X86
+    if (fn == scan_avx2)
+	return "avx2";
+    if (fn == scan_sse2)
+	return "sse2";
+#endif
+    return "portable";
+}
+
+/*
+ * Copy a line flagged SYNCSH_SCAN_ESC to 'buf' without its escape
+ * sequences: CSI (colours, erasing), OSC (titles, hyperlinks) and
+ * two-byte ones. Returns the new length.
+ */
+static size_t
+scan_strip(const char *p, size_t len, char *buf)
+{
+    const char *end = p + len;
+    size_t n = 0;
+
+    while (p < end) {
+	if (*p != '\033') {
+	    buf[n++] = *p++;
+	    continue;
+	}
+	if (++p == end)
+	    break;
+	if (*p == '[') {
+	    for (p++; p < end && (unsigned char)*p >= 0x20 && (unsigned char)*p < 0x40; p++)
+		;
+	    if (p < end)
+		p++;		/* the final byte */
+	} else if (*p == ']') {
+	    for (p++; p < end && *p != '\a' && *p != '\033'; p++)
+		;
+	    if (p < end)
+		p += *p == '\a' ? 1 : 2;
+	} else {
+	    p++;
+	}
+    }
+
+    return n;
+}
+
+/*
+ * Copy 'str' into 'buf' with tabs, newlines and backslashes escaped
+ * so it fits in one record field, truncating to 'max' bytes.
+ */
+static size_t
+rec_escape(char *buf, size_t max, const char *str)
+{
+    const char *stop = str + strlen(str), *end;
+    struct syncsh_line line;
+    size_t n = 0, k;
+
+    while (str < stop && n + 3 < max) {
+	syncsh_scan_lines(str, stop - str, &line, 1);
+	end = str + line.len;
+	if (!line.flags) {
+	    /* Nothing to escape but the newline, if there is one. */
+	    k = line.len - (end[-1] == '\n');
+	    if (k > max - 3 - n)
+		k = max - 3 - n;
+	    memcpy(buf + n, str, k);
+	    n += k;
+	    str += k;
+	}
+	for (; str < end && n + 3 < max; str++) {
+	    if (*str == '\t' || *str == '\n' || *str == '\\') {
+		buf[n++] = '\\';
+		buf[n++] = *str == '\t' ? 't' : *str == '\n' ? 'n' : '\\';
+	    } else {
+		buf[n++] = *str;
+	    }
+	}
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+/* Open the shard file for the CPU we're on. */
+static int
+record_open(const char *dir)
+{
+    char path[PATH_MAX];
+    int cpu = -1, fd;
+
+    if (!is_absolute(dir)) {
+	fprintf(stderr, "%s: Error: '%s' not an absolute path\n", prog, dir);
+	return -1;
+    }
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+	syserr(0, dir);
+	return -1;
+    }
+
+#ifdef __linux__
+    cpu = sched_getcpu();
+#endif
+    if (cpu < 0)
+	cpu = getpid() % 64;
+    snprintf(path, sizeof(path), "%s/cpu%d.rec", dir, cpu);
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1)
+	syserr(0, path);
+
+    return fd;
+}
+
+static void
+record_stats(struct syncsh_job *j, int fd)
+{
+    char rec[PIPE_BUF];
+    char cwd[PATH_MAX];
+    char *build, *lvl;
+    size_t n;
+
+    if (!(lvl = getenv("MAKELEVEL")))
+	lvl = "";
+    n = snprintf(rec, sizeof(rec),
+		 "v=1\tpid=%ld\tlvl=%s\tt0=%lld\tt1=%lld\tst=%d"
+		 "\tlw=%lld\tlh=%lld\tob=%lld\teb=%lld\tsp=%ld"
+		 "\trss=%ld\tut=%lld\tkt=%lld\th=%016llx",
+		 (long)getpid(), lvl,
+		 (long long)j->stats.start, (long long)j->stats.end, j->stats.exitcode,
+		 (long long)j->stats.lockwait, (long long)j->stats.lockhold,
+		 (long long)j->stats.outbytes, (long long)j->stats.errbytes,
+		 j->stats.spills, j->stats.ru.ru_maxrss,
+		 (long long)j->stats.ru.ru_utime.tv_sec * 1000000 + j->stats.ru.ru_utime.tv_usec,
+		 (long long)j->stats.ru.ru_stime.tv_sec * 1000000 + j->stats.ru.ru_stime.tv_usec,
+		 (unsigned long long)str_hash64(j->recipe, strlen(j->recipe)));
+    if (j->stats.serwait >= 0 && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tsw=%lld",
+		      (long long)j->stats.serwait);
+    if (j->stats.capwait >= 0 && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tcw=%lld",
+		      (long long)j->stats.capwait);
+    if ((build = getenv(PFX "BUILD")) && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tb=%s", build);
+    if (j->cls && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tc=%s", j->cls->name);
+    if (j->stats.cache && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tch=%s",
+		      j->stats.cache == 2 ? "hit" : "miss");
+    if (j->stats.cgroup && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n,
+		      "\tcgm=%lld\tcgc=%lld\tcgr=%lld\tcgw=%lld",
+		      j->stats.cgmem, j->stats.cgcpu, j->stats.cgread, j->stats.cgwrite);
+    if (j->stats.coalesced && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tco=%s",
+		      j->stats.coalesced == 2 ? "follow" : "lead");
+    if (j->stats.held >= 0 && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tcz=%lld",
+		      (long long)j->stats.held);
+    if (j->stats.budgetpeak >= 0 && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tmp=%lld",
+		      (long long)j->stats.budgetpeak);
+    if (j->stats.spooled && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tov=%s",
+		      j->stats.spooled == 2 ? "write" : "lock");
+    if (j->stats.summarized && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\tsm=1");
+    if (j->stats.admitwait >= 0 && n < sizeof(rec))
+	n += snprintf(rec + n, sizeof(rec) - n, "\taw=%lld\tam=%lld",
+		      (long long)j->stats.admitwait, (long long)j->stats.admitted);
+    if (getcwd(cwd, sizeof(cwd)) && n + 3 < sizeof(rec) / 2) {
+	n += snprintf(rec + n, sizeof(rec) - n, "\td=");
+	n += rec_escape(rec + n, sizeof(rec) / 2 - n, cwd);
+    }
+    if (n + 3 < sizeof(rec) - 1) {
+	n += snprintf(rec + n, sizeof(rec) - n, "\tr=");
+	n += rec_escape(rec + n, sizeof(rec) - 1 - n, j->recipe);
+    }
+    if (n >= sizeof(rec))
+	n = sizeof(rec) - 1;
+    rec[n++] = '\n';
+
+    if (write(fd, rec, n) != (ssize_t) n)
+	syserr(0, "write(stats)");
+}
+
+/*
+ * SHA-256, used where a hash must be safe to trust as an identity
+ * (e.g. cache keys and content-addressed objects).
+ */
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t n;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(struct sha256 *s, const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+	w[i] = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    for (; i < 64; i++)
+	w[i] = w[i - 16] + w[i - 7]
+	    + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3))
+	    + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+    for (i = 0; i < 64; i++) {
+	t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+	    + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+	    + ((a & b) ^ (a & c) ^ (b & c));
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void
+sha256_init(struct sha256 *s)
+{
+    static const uint32_t iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->n = 0;
+}
+
+static void
+sha256_update(struct sha256 *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    s->len += len;
+    while (len) {
+	size_t take = sizeof(s->buf) - s->n;
+
+	if (take > len)
+	    take = len;
+	memcpy(s->buf + s->n, p, take);
+	s->n += take;
+	p += take;
+	len -= take;
+	if (s->n == sizeof(s->buf)) {
+	    sha256_block(s, s->buf);
+	    s->n = 0;
+	}
+    }
+}
+
+/* Finish the hash and render it as 64 hex digits plus a NUL. */
+static void
+sha256_hex(struct sha256 *s, char *hex)
+{
+    uint64_t bits = s->len * 8;
+    unsigned char pad = 0x80;
+    int i;
+
+    sha256_update(s, &pad, 1);
+    pad = 0;
+    while (s->n != 56)
+	sha256_update(s, &pad, 1);
+    for (i = 7; i >= 0; i--) {
+	pad = (unsigned char)(bits >> (i * 8));
+	sha256_update(s, &pad, 1);
+    }
+    for (i = 0; i < 8; i++)
+	sprintf(hex + i * 8, "%08x", s->h[i]);
+}
+
+/*
+ * Capture files. SYNCSH_CAPTURE=memory keeps captured output in
+ * anonymous memory (a memfd) instead of a tmpfile, saving the disk
+ * writes on hosts with memory to spare. The default is "file". Under
+ * SYNCSH_MEMBUDGET memory is only held by capture arenas, which spill
+ * to these files, so they are always tmpfiles.
+ */
+static FILE *
+capture_open(void)
+{
+#ifdef __linux__
+    char *mode = getenv(PFX "CAPTURE");
+    FILE *fp;
+    int fd;
+
+    if (mode && !strcmp(mode, "memory") && !getenv(PFX "MEMBUDGET")
+	&& (fd = memfd_create("syncsh", 0)) != -1) {
+	if ((fp = fdopen(fd, "w+")))
+	    return fp;
+	close(fd);
+    }
+#endif
+    return tmpfile();
+}
+
+static int
+sha256_file(const char *path, char *hex)
+{
+    struct sha256 s;
+    char buffer[65536];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+	return -1;
+    sha256_init(&s);
+    while (1) {
+	EINTR_CHECK(n, read(fd, buffer, sizeof(buffer)));
+	if (n <= 0)
+	    break;
+	sha256_update(&s, buffer, n);
+    }
+    close(fd);
+    if (n < 0)
+	return -1;
+    sha256_hex(&s, hex);
+
+    return 0;
+}
+
+/*
+ * Call 'fn' for each file matched by a comma-separated glob list,
+ * in glob(3) order. Stops early if 'fn' returns non-zero.
+ */
+static int
+foreach_glob(const char *list, int (*fn)(const char *, void *), void *arg)
+{
+    char *copy, *pat, *save = NULL;
+    glob_t g;
+    size_t i;
+    int rc = 0;
+
+    if (!list)
+	return 0;
+    copy = strdup(list);
+    for (pat = strtok_r(copy, ",", &save); pat && !rc;
+	 pat = strtok_r(NULL, ",", &save)) {
+	if (glob(pat, 0, NULL, &g))
+	    continue;
+	for (i = 0; i < g.gl_pathc && !rc; i++)
+	    rc = fn(g.gl_pathv[i], arg);
+	globfree(&g);
+    }
+    free(copy);
+
+    return rc;
+}
+
+/*
+ * Memoization cache. A class with cache=1 has its output stored in
+ * SYNCSH_CACHE under a key hashed from the shell, recipe text, cwd,
+ * the class's chosen environment variables and the contents of its
+ * input files. Declared output files go into a content-addressed
+ * object store (o/<sha256>) and entries (k/<key>) look like
+ *
+ *     syncsh-cache 1
+ *     status <exit code>
+ *     stdout <bytes>
+ *     stderr <bytes>
+ *     output <mode> <sha256> <path>
+ *     ...
+ *     <blank line><stdout bytes><stderr bytes>
+ *
+ * Both are written under temporary names and renamed into place, so
+ * concurrent builds sharing a cache only ever see complete entries.
+ */
+#define CACHE_MAGIC	"syncsh-cache 1\n"
+
+static int
+cache_hash_input(const char *path, void *arg)
+{
+    char hex[65];
+
+    if (sha256_file(path, hex) == -1)
+	return -1;
+    sha256_update(arg, path, strlen(path) + 1);
+    sha256_update(arg, hex, sizeof(hex));
+
+    return 0;
+}
+
+static int
+cache_key(const struct class *c, const char *shell, const char *recipe,
+	  char *key)
+{
+    struct sha256 s;
+    char cwd[PATH_MAX];
+    char *names, *name, *val, *save = NULL;
+
+    if (!getcwd(cwd, sizeof(cwd)))
+	return -1;
+    sha256_init(&s);
+    sha256_update(&s, CACHE_MAGIC, strlen(CACHE_MAGIC));
+    sha256_update(&s, shell, strlen(shell) + 1);
+    sha256_update(&s, recipe, strlen(recipe) + 1);
+    sha256_update(&s, cwd, strlen(cwd) + 1);
+    if (c->env) {
+	names = strdup(c->env);
+	for (name = strtok_r(names, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+	    sha256_update(&s, name, strlen(name) + 1);
+	    if ((val = getenv(name)))
+		sha256_update(&s, val, strlen(val) + 1);
+	}
+	free(names);
+    }
+    if (foreach_glob(c->inputs, cache_hash_input, &s))
+	return -1;
+    sha256_hex(&s, key);
+
+    return 0;
+}
+
+/* Copy 'len' bytes (or to EOF if len < 0) between descriptors. */
+static int
+copy_fd(int from_fd, int to_fd, off_t len)
+{
+    char buffer[65536];
+    ssize_t n, w;
+
+    while (len) {
+	size_t want = sizeof(buffer);
+
+	if (len > 0 && (off_t) want > len)
+	    want = len;
+	EINTR_CHECK(n, read(from_fd, buffer, want));
+	if (n <= 0)
+	    return len > 0 || n < 0 ? -1 : 0;
+	if (len > 0)
+	    len -= n;
+	for (w = 0; w < n;) {
+	    ssize_t nw;
+
+	    EINTR_CHECK(nw, write(to_fd, buffer + w, n - w));
+	    if (nw < 0)
+		return -1;
+	    w += nw;
+	}
+    }
+
+    return 0;
+}
+
+/* Copy a file into place via a temporary name and rename(). */
+static int
+cache_install(const char *from, const char *to, mode_t mode)
+{
+    char tmp[PATH_MAX];
+    int ifd, ofd, rc;
+
+    snprintf(tmp, sizeof(tmp), "%s.syncsh%ld", to, (long)getpid());
+    if ((ifd = open(from, O_RDONLY)) == -1)
+	return -1;
+    if ((ofd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode)) == -1) {
+	close(ifd);
+	return -1;
+    }
+    rc = copy_fd(ifd, ofd, -1);
+    close(ifd);
+    if (close(ofd) || rc || fchmodat(AT_FDCWD, tmp, mode, 0)
+	|| rename(tmp, to)) {
+	unlink(tmp);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Look up 'key'. On a hit the declared outputs are restored, the
+ * recorded stdout and stderr are copied into the capture files as
+ * if the recipe had written them, and 1 is returned. Returns -1 if
+ * a partial replay could not be undone.
+ */
+static int
+cache_replay(const char *dir, const char *key, FILE *out, FILE *err,
+	     int *exitcode)
+{
+    char path[PATH_MAX], obj[PATH_MAX];
+    char line[PATH_MAX + 128];
+    char hash[65], opath[sizeof(line)];
+    long long olen = -1, elen = -1;
+    unsigned mode;
+    FILE *fp;
+    int hit = 0;
+
+    snprintf(path, sizeof(path), "%s/k/%s", dir, key);
+    if (!(fp = fopen(path, "r")))
+	return 0;
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, CACHE_MAGIC))
+	goto out;
+    while (fgets(line, sizeof(line), fp) && *line != '\n') {
+	line[strcspn(line, "\n")] = '\0';
+	if (sscanf(line, "status %d", exitcode) == 1
+	    || sscanf(line, "stdout %lld", &olen) == 1
+	    || sscanf(line, "stderr %lld", &elen) == 1)
+	    continue;
+	if (sscanf(line, "output %o %64s %[^\n]", &mode, hash, opath) != 3)
+	    goto out;
+	snprintf(obj, sizeof(obj), "%s/o/%s", dir, hash);
+	if (cache_install(obj, opath, mode) == -1)
+	    goto out;
+    }
+    if (olen < 0 || elen < 0)
+	goto out;
+
+    /* The stdio buffer may have read ahead; hand over the real offset. */
+    if (lseek(fileno(fp), ftello(fp), SEEK_SET) == -1
+	|| copy_fd(fileno(fp), fileno(out), olen)
+	|| copy_fd(fileno(fp), fileno(err), elen))
+	goto out;
+    hit = 1;
+
+  out:
+    fclose(fp);
+    if (!hit && (ftruncate(fileno(out), 0) || ftruncate(fileno(err), 0)
+		 || lseek(fileno(out), 0, SEEK_SET) || lseek(fileno(err), 0, SEEK_SET))) {
+	syserr(0, "ftruncate");
+	return -1;
+    }
+
+    return hit;
+}
+
+static int
+cache_add_output(const char *opath, void *arg)
+{
+    const char *dir = ((const char **)arg)[0];
+    FILE *fp = ((FILE **) arg)[1];
+    char hash[65], obj[PATH_MAX];
+    struct stat st;
+
+    if (stat(opath, &st) == -1 || !S_ISREG(st.st_mode)
+	|| sha256_file(opath, hash) == -1)
+	return -1;
+    snprintf(obj, sizeof(obj), "%s/o/%s", dir, hash);
+    if (access(obj, F_OK) == -1 && cache_install(opath, obj, 0444) == -1)
+	return -1;
+    fprintf(fp, "output %o %s %s\n", (unsigned)(st.st_mode & 07777), hash,
+	    opath);
+
+    return 0;
+}
+
+static void
+cache_store(struct syncsh_job *j)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    void *arg[2];
+    FILE *fp;
+    int rc;
+
+    snprintf(path, sizeof(path), "%s/k/%s", j->cachedir, j->cachekey);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+    if (!(fp = fopen(tmp, "w"))) {
+	syserr(0, tmp);
+	return;
+    }
+    fprintf(fp, CACHE_MAGIC "status %d\nstdout %lld\nstderr %lld\n",
+	    j->stats.exitcode, (long long)j->stats.outbytes,
+	    (long long)j->stats.errbytes);
+    arg[0] = (void *)j->cachedir;
+    arg[1] = fp;
+    rc = foreach_glob(j->cls->outputs, cache_add_output, arg);
+    fputc('\n', fp);
+    if (!rc && fflush(fp) == 0) {
+	pump_from_tmp_fd(fileno(j->out), fileno(fp));
+	pump_from_tmp_fd(fileno(j->err), fileno(fp));
+    }
+    if (fclose(fp) || rc || rename(tmp, path)) {
+	unlink(tmp);
+	return;
+    }
+    lseek(fileno(j->out), 0, SEEK_SET);
+    lseek(fileno(j->err), 0, SEEK_SET);
+}
+
+static int
+cache_init(const char *dir)
+{
+    char path[PATH_MAX];
+
+    if (!is_absolute(dir)) {
+	fprintf(stderr, "%s: Error: '%s' not an absolute path\n", prog, dir);
+	return -1;
+    }
+    snprintf(path, sizeof(path), "%s/o", dir);
+    if ((mkdir(dir, 0777) && errno != EEXIST)
+	|| (mkdir(path, 0777) && errno != EEXIST)) {
+	syserr(0, path);
+	return -1;
+    }
+    snprintf(path, sizeof(path), "%s/k", dir);
+    if (mkdir(path, 0777) && errno != EEXIST) {
+	syserr(0, path);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Build-wide shared state. Instances which synchronize on the same
+ * output also share a small memory-mapped state file, named by
+ * SYNCSH_STATE or else derived from the identity of the sync file
+ * descriptor. Updates are guarded by fcntl() byte locks on the state
+ * file itself so, like the output semaphore, they are released
+ * automatically if the holder dies.
+ */
+#define SHM_MAGIC	0x53594e43
+#define SHM_LOCK_INIT	0	/* lock byte guarding (re)initialization */
+#define SHM_LOCK_TABLE	1	/* lock byte guarding table updates */
+#define SHM_LOCK_SLOT	1024	/* base of per-slot lock bytes */
+
+#define INFLIGHT_SLOTS	256
+#define PIN_DOMAINS	64
+#define PIN_SLOTS	256
+#define BUDGET_SLOTS	256
+#define STATUS_SLOTS	256
+#define STATUS_NAME	64
+#define ADMIT_SLOTS	256
+#define ADMIT_HISTORY	4096
+#define ADMIT_PROBES	8
+
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_DONE };
+
+struct inflight {
+    char key[65];		/* hash of shell, recipe and cwd */
+    pid_t owner;
+    int state;
+    int exitcode;
+    int readers;		/* instances waiting on the result */
+    unsigned gen;
+};
+
+#ifdef __linux__
+struct pindomain {
+    cpu_set_t cpus;
+    int ncpus;
+    int node;
+};
+#endif
+
+struct budget_slot {
+    pid_t pid;
+    int64_t bytes;		/* reserved */
+};
+
+struct status_slot {
+    pid_t pid;			/* running recipe, or 0 */
+    int64_t start;
+    char name[STATUS_NAME];
+};
+
+struct admit_peak {
+    uint64_t key;		/* hash of recipe and cwd, or 0 */
+    int64_t peak;		/* bytes */
+};
+
+struct shared {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t build;		/* build_id() of the last to map it */
+    struct inflight inflight[INFLIGHT_SLOTS];
+    int64_t budget_used, budget_peak;
+    struct budget_slot budget[BUDGET_SLOTS];
+    uint64_t tee_seq;		/* last sharded tee entry */
+    int64_t sink_rate;		/* terminal drain estimate, bytes/sec */
+    int64_t sink_probe;		/* last full write while slow, usec */
+    int sink_slow;		/* terminal gets summaries only */
+    uint32_t status_started, status_finished;
+    int64_t status_last;	/* last recipe start or end, usec */
+    int64_t status_drawn;	/* last status line, usec */
+    struct status_slot status[STATUS_SLOTS];
+    struct budget_slot admit[ADMIT_SLOTS];
+    struct admit_peak peaks[ADMIT_HISTORY];
+#ifdef __linux__
+    int ndomains;		/* 0 = not yet read, -1 = none */
+    struct pindomain domains[PIN_DOMAINS];
+    struct {
+	pid_t pid;
+	int domain;
+    } pins[PIN_SLOTS];
+#endif
+};
+
+static struct shared *shm;
+static int shmfd = -1;
+static char shmpath[PATH_MAX];
+
+static int
+shm_lock(off_t off, short type, int wait)
+{
+    struct flock fl;
+    int rc;
+
+    if (off == SHM_LOCK_TABLE && type != F_UNLCK)
+	pthread_mutex_lock(&table_mutex);
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = off;
+    fl.l_len = 1;
+    EINTR_CHECK(rc, fcntl(shmfd, wait ? F_SETLKW : F_SETLK, &fl));
+    if (off == SHM_LOCK_TABLE && type == F_UNLCK)
+	pthread_mutex_unlock(&table_mutex);
+
+    return rc;
+}
+
+static int
+pid_alive(pid_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/* A per-build file in $TMPDIR named after the identity of the sync file. */
+static int
+sync_path(int syncfd, const char *ext, char *path, size_t size)
+{
+    struct stat st;
+    char *tmp;
+
+    if (fstat(syncfd, &st) == -1)
+	return -1;
+    if (!(tmp = getenv("TMPDIR")))
+	tmp = "/tmp";
+    snprintf(path, size, "%s/syncsh-%ld-%lx-%lx.%s", tmp, (long)getuid(),
+	     (unsigned long)st.st_dev, (unsigned long)st.st_ino, ext);
+
+    return 0;
+}
+
+#ifdef __linux__
+/* A process's MAKELEVEL, "" if it has none, or NULL if it can't be read. */
+static char *
+proc_makelevel(pid_t pid, char *val, size_t size)
+{
+    char path[64], buf[65536], *p, *end;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/environ", (long)pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	return NULL;
+    EINTR_CHECK(n, read(fd, buf, sizeof(buf) - 1));
+    close(fd);
+    if (n < 0)
+	return NULL;
+    buf[n] = '\0';
+    *val = '\0';
+    for (p = buf, end = buf + n; p < end; p += strlen(p) + 1)
+	if (!strncmp(p, "MAKELEVEL=", 10)) {
+	    snprintf(val, size, "%s", p + 10);
+	    break;
+	}
+
+    return val;
+}
+
+/* Whether a process is make, by its name in /proc/<pid>/comm. */
+static int
+proc_is_make(pid_t pid)
+{
+    char path[64], name[32];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/comm", (long)pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	return 0;
+    EINTR_CHECK(n, read(fd, name, sizeof(name) - 1));
+    close(fd);
+    if (n <= 0)
+	return 0;
+    name[n] = '\0';
+    name[strcspn(name, "\n")] = '\0';
+
+    return !strcmp(name, "make") || !strcmp(name, "gmake");
+}
+
+/* A process's parent and start time, from /proc/<pid>/stat. */
+static int
+proc_stat(pid_t pid, pid_t *ppid, unsigned long long *start)
+{
+    char path[64], buf[1024], *p;
+    ssize_t n;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	return -1;
+    EINTR_CHECK(n, read(fd, buf, sizeof(buf) - 1));
+    close(fd);
+    if (n <= 0)
+	return -1;
+    buf[n] = '\0';
+
+    /* The name may hold anything, so count fields from its end. */
+    if (!(p = strrchr(buf, ')')))
+	return -1;
+    for (i = 0; i < 19 && p; i++) {
+	p = strchr(p + 1, ' ');
+	if (i == 1 && p)
+	    *ppid = atol(p + 1);
+    }
+    if (!p)
+	return -1;
+    *start = strtoull(p + 1, NULL, 10);
+
+    return 0;
+}
+#endif
+
+/*
+ * The build: SYNCSH_BUILD, or the top-level make, the nearest ancestor
+ * without MAKELEVEL, identified by its pid and start time. 0 if it
+ * can't be told.
+ */
+static uint64_t
+build_id(void)
+{
+    char *build = getenv(PFX "BUILD");
+#ifdef __linux__
+    unsigned long long start;
+    pid_t pid = getppid(), ppid = 0;
+    char level[32];
+    int depth;
+#endif
+
+    if (build)
+	return str_hash64(build, strlen(build)) | 1;
+#ifdef __linux__
+    for (depth = 0; pid > 1 && depth < 64; depth++, pid = ppid) {
+	if (!proc_makelevel(pid, level, sizeof(level))
+	    || proc_stat(pid, &ppid, &start) == -1)
+	    break;
+	if (!*level)
+	    return ((uint64_t) pid << 40 ^ start) | 1;
+    }
+#endif
+
+    return 0;
+}
+
+static struct shared *
+shm_map(int syncfd)
+{
+    struct stat st;
+    uint64_t build;
+    char *path;
+    void *p;
+
+    if ((path = getenv(PFX "STATE"))) {
+	if (!is_absolute(path)) {
+	    fprintf(stderr, "%s: Error: '%s' not an absolute path\n",
+		    prog, path);
+	    return NULL;
+	}
+	snprintf(shmpath, sizeof(shmpath), "%s", path);
+    } else if (sync_path(syncfd, "state", shmpath, sizeof(shmpath)) == -1) {
+	return NULL;
+    }
+
+    if ((shmfd = open(shmpath, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		      0600)) == -1) {
+	syserr(0, shmpath);
+	return NULL;
+    }
+    shm_lock(SHM_LOCK_INIT, F_WRLCK, 1);
+    if (fstat(shmfd, &st) == -1
+	|| (st.st_size != sizeof(struct shared)
+	    && (ftruncate(shmfd, 0) || ftruncate(shmfd, sizeof(struct shared))))
+	|| (p = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, shmfd, 0)) == MAP_FAILED) {
+	syserr(0, shmpath);
+	shm_lock(SHM_LOCK_INIT, F_UNLCK, 0);
+	close(shmfd);
+	shmfd = -1;
+	return NULL;
+    }
+    shm = p;
+    if (shm->magic != SHM_MAGIC || shm->size != sizeof(struct shared)) {
+	memset(shm, 0, sizeof(struct shared));
+	shm->magic = SHM_MAGIC;
+	shm->size = sizeof(struct shared);
+    }
+
+    /*
+     * The file outlives the build, so what was learned about this one
+     * (which may run in another cpuset, or to another terminal)
+     * starts afresh in the next.
+     */
+    if ((build = build_id()) && build != shm->build) {
+	shm->build = build;
+	shm->sink_rate = shm->sink_probe = 0;
+	shm->sink_slow = 0;
+#ifdef __linux__
+	shm->ndomains = 0;
+	memset(shm->pins, 0, sizeof(shm->pins));
+#endif
+    }
+    shm_lock(SHM_LOCK_INIT, F_UNLCK, 0);
+
+    return shm;
+}
+
+static struct shared *
+shm_attach(int syncfd)
+{
+    pthread_mutex_lock(&attach_mutex);
+    if (!shm)
+	shm_map(syncfd);
+    pthread_mutex_unlock(&attach_mutex);
+
+    return shm;
+}
+
+/*
+ * Coalescing of identical recipes. With SYNCSH_COALESCE set, an
+ * instance finding the same recipe (same shell, text and cwd) already
+ * running elsewhere in the build waits for it instead of racing it,
+ * then replays its output and exit status. The running instance holds
+ * a write lock on its slot's lock byte for the duration, so waiters
+ * simply block on a read lock; if the owner dies the lock goes away
+ * and the waiters find the slot still RUNNING and run the recipe
+ * themselves.
+ */
+enum { COALESCE_NONE, COALESCE_OWNER, COALESCE_REPLAY };
+
+static void
+coalesce_path(char *path, size_t size, int slot, unsigned gen,
+	      const char *ext)
+{
+    snprintf(path, size, "%s.%d.%u.%s", shmpath, slot, gen, ext);
+}
+
+static void
+coalesce_key(const char *shell, const char *recipe, char *key)
+{
+    struct sha256 s;
+    char cwd[PATH_MAX];
+
+    if (!getcwd(cwd, sizeof(cwd)))
+	cwd[0] = '\0';
+    sha256_init(&s);
+    sha256_update(&s, shell, strlen(shell) + 1);
+    sha256_update(&s, recipe, strlen(recipe) + 1);
+    sha256_update(&s, cwd, strlen(cwd) + 1);
+    sha256_hex(&s, key);
+}
+
+/* Drop a reader's interest in a finished slot; the last one frees it. */
+static void
+coalesce_detach(struct inflight *in, int slot)
+{
+    char path[PATH_MAX + 32];
+
+    if (--in->readers > 0)
+	return;
+    if (in->state == SLOT_DONE || !pid_alive(in->owner)) {
+	coalesce_path(path, sizeof(path), slot, in->gen, "out");
+	unlink(path);
+	coalesce_path(path, sizeof(path), slot, in->gen, "err");
+	unlink(path);
+	in->state = SLOT_FREE;
+    }
+}
+
+static int
+coalesce_begin(struct syncsh_job *j)
+{
+    struct inflight *in, *mine = NULL;
+    char key[65], path[PATH_MAX + 32];
+    unsigned gen;
+    int i, slot = -1, rc = COALESCE_NONE;
+
+    coalesce_key(j->shell, j->recipe, key);
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    for (i = 0; i < INFLIGHT_SLOTS; i++) {
+	in = &shm->inflight[i];
+	if (in->state == SLOT_RUNNING && !strcmp(in->key, key)
+	    && pid_alive(in->owner))
+	    break;
+	if (!mine && (in->state == SLOT_FREE
+		      || (in->state == SLOT_RUNNING && !in->readers
+			  && !pid_alive(in->owner)))) {
+	    mine = in;
+	    slot = i;
+	}
+    }
+
+    if (i == INFLIGHT_SLOTS) {
+	/* Nobody else is running it; claim a slot if there is one. */
+	if (mine) {
+	    memcpy(mine->key, key, sizeof(key));
+	    mine->owner = getpid();
+	    mine->state = SLOT_RUNNING;
+	    mine->readers = 0;
+	    mine->gen++;
+	    shm_lock(SHM_LOCK_SLOT + slot, F_WRLCK, 0);
+	    j->coalesce_slot = slot;
+	}
+	shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+	return mine ? COALESCE_OWNER : COALESCE_NONE;
+    }
+
+    in->readers++;
+    gen = in->gen;
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+
+    if (getenv(PFX "DEBUG"))
+	fprintf(stderr, "%s: waiting on pid %ld for '%s'\n", prog,
+		(long)in->owner, j->recipe);
+    shm_lock(SHM_LOCK_SLOT + i, F_RDLCK, 1);
+    shm_lock(SHM_LOCK_SLOT + i, F_UNLCK, 0);
+
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    if (in->gen == gen) {
+	if (in->state == SLOT_DONE) {
+	    FILE *o, *e;
+
+	    coalesce_path(path, sizeof(path), i, gen, "out");
+	    o = fopen(path, "r");
+	    coalesce_path(path, sizeof(path), i, gen, "err");
+	    e = fopen(path, "r");
+	    if (o && e) {
+		if (j->out)
+		    fclose(j->out);
+		if (j->err)
+		    fclose(j->err);
+		j->out = o;
+		j->err = e;
+		j->stats.exitcode = in->exitcode;
+		rc = COALESCE_REPLAY;
+	    } else {
+		if (o)
+		    fclose(o);
+		if (e)
+		    fclose(e);
+	    }
+	}
+	coalesce_detach(in, i);
+    }
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+
+    return rc;
+}
+
+/*
+ * Publish the owner's result to any waiters and release the slot.
+ * Without a result (the job was abandoned) they run it themselves.
+ */
+static void
+coalesce_end(struct syncsh_job *j)
+{
+    struct inflight *in = &shm->inflight[j->coalesce_slot];
+    char path[PATH_MAX + 32];
+    int fd, rc = 0, i;
+
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    if (in->readers && (!j->out || !j->err)) {
+	in->owner = 0;
+    } else if (in->readers) {
+	for (i = 0; i < 2 && !rc; i++) {
+	    coalesce_path(path, sizeof(path), j->coalesce_slot, in->gen,
+			  i ? "err" : "out");
+	    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		rc = -1;
+		break;
+	    }
+	    if (lseek(fileno(i ? j->err : j->out), 0, SEEK_SET) == -1
+		|| copy_fd(fileno(i ? j->err : j->out), fd, -1))
+		rc = -1;
+	    close(fd);
+	}
+	lseek(fileno(j->out), 0, SEEK_SET);
+	lseek(fileno(j->err), 0, SEEK_SET);
+	in->exitcode = j->stats.exitcode;
+	in->state = rc ? SLOT_RUNNING : SLOT_DONE;
+	in->owner = rc ? 0 : in->owner;
+    } else {
+	in->state = SLOT_FREE;
+    }
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+    shm_lock(SHM_LOCK_SLOT + j->coalesce_slot, F_UNLCK, 0);
+    j->coalesce_slot = -1;
+}
+
+/*
+ * The capture memory budget. SYNCSH_MEMBUDGET=<size> bounds the output
+ * held in memory by all the build's capture arenas together. Each
+ * arena claims a slot in the shared state and reserves every chunk it
+ * keeps there. Once three quarters of the budget is taken new chunks
+ * are compressed whatever the threshold, and when one won't fit at
+ * all the recipe's capture moves to disk. Reservations are released
+ * when the job ends, and reclaimed from processes which have died.
+ */
+static int
+budget_claim(void)
+{
+    struct budget_slot *b;
+    int i, slot = -1;
+
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    for (i = 0; i < BUDGET_SLOTS; i++) {
+	b = &shm->budget[i];
+	if (b->pid && !pid_alive(b->pid)) {
+	    __atomic_sub_fetch(&shm->budget_used, b->bytes, __ATOMIC_RELAXED);
+	    b->bytes = 0;
+	    b->pid = 0;
+	}
+	if (!b->pid && slot < 0)
+	    slot = i;
+    }
+    if (slot >= 0)
+	shm->budget[slot].pid = getpid();
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+
+    return slot;
+}
+
+static int
+budget_tight(int64_t limit)
+{
+    return __atomic_load_n(&shm->budget_used, __ATOMIC_RELAXED) > limit - limit / 4;
+}
+
+/* Reserve 'n' more bytes, or return -1 if the budget won't stretch. */
+static int
+budget_reserve(int slot, int64_t limit, int64_t n)
+{
+    int64_t used, peak;
+
+    used = __atomic_add_fetch(&shm->budget_used, n, __ATOMIC_RELAXED);
+    if (used > limit) {
+	__atomic_sub_fetch(&shm->budget_used, n, __ATOMIC_RELAXED);
+	return -1;
+    }
+    __atomic_add_fetch(&shm->budget[slot].bytes, n, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&shm->budget_peak, __ATOMIC_RELAXED);
+    while (used > peak
+	   && !__atomic_compare_exchange_n(&shm->budget_peak, &peak, used, 0,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	continue;
+
+    return 0;
+}
+
+/*
+ * Give back what a slot holds, and optionally the slot too. Returns
+ * the peak so far, which a holder records as it lets go.
+ */
+static int64_t
+budget_release(int slot, int all)
+{
+    int64_t n = __atomic_exchange_n(&shm->budget[slot].bytes, 0, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&shm->budget_peak, __ATOMIC_RELAXED);
+
+    /*
+     * The state file outlives the build, so the peak starts over once
+     * nothing is held. Every holder has recorded it by then.
+     */
+    if (n && !__atomic_sub_fetch(&shm->budget_used, n, __ATOMIC_RELAXED))
+	__atomic_compare_exchange_n(&shm->budget_peak, &peak, 0, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    if (all)
+	__atomic_store_n(&shm->budget[slot].pid, 0, __ATOMIC_RELEASE);
+
+    return peak;
+}
+
+/*
+ * Memory admission, SYNCSH_ADMIT=<budget>[:<default>]. Before a recipe
+ * is spawned it reserves its predicted peak memory from <budget> (a
+ * size, or a percentage of physical memory) in the shared state, and
+ * waits while that won't fit. The prediction is the peak RSS the same
+ * recipe in the same directory reached last time, remembered in the
+ * state file, or <default> (a quarter of the budget) for recipes not
+ * seen before. When the recipe exits the reservation goes and the
+ * actual peak is recorded: a higher one replaces the prediction, a
+ * lower one only brings it halfway down, so one lucky run doesn't
+ * undo it. A recipe is always admitted when nothing else holds any
+ * of the budget, however much it's expected to need.
+ */
+static int
+admit_limits(int64_t *budget, int64_t *dflt)
+{
+    char *val = getenv(PFX "ADMIT");
+    char buf[64], *colon, *end;
+    long long n;
+
+    if (!val || !*val)
+	return 0;
+    snprintf(buf, sizeof(buf), "%s", val);
+    if ((colon = strchr(buf, ':')))
+	*colon++ = '\0';
+    n = strtoll(buf, &end, 10);
+    if (end != buf && !strcmp(end, "%") && n > 0 && n <= 100)
+	*budget = (int64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 100 * n;
+    else
+	*budget = parse_size(buf);
+    if (*budget <= 0) {
+	fprintf(stderr, "%s: Error: bad " PFX "ADMIT '%s'\n", prog, val);
+	return 0;
+    }
+    if (!colon || (*dflt = parse_size(colon)) <= 0)
+	*dflt = *budget / 4;
+
+    return 1;
+}
+
+static uint64_t
+admit_key(const char *recipe)
+{
+    char cwd[PATH_MAX];
+    uint64_t key = str_hash64(recipe, strlen(recipe));
+
+    if (getcwd(cwd, sizeof(cwd)))
+	key ^= str_hash64(cwd, strlen(cwd)) * 0x9e3779b97f4a7c15ULL;
+
+    return key ? key : 1;
+}
+
+/* The recorded peak for 'key', or 0. Called with the table locked. */
+static int64_t
+admit_predict(uint64_t key)
+{
+    struct admit_peak *p;
+    int i;
+
+    for (i = 0; i < ADMIT_PROBES; i++) {
+	p = &shm->peaks[(key + i) & (ADMIT_HISTORY - 1)];
+	if (p->key == key)
+	    return p->peak;
+    }
+
+    return 0;
+}
+
+/* Called with the table locked; a full run of probes loses its first. */
+static void
+admit_record(uint64_t key, int64_t peak)
+{
+    struct admit_peak *p, *slot = &shm->peaks[key & (ADMIT_HISTORY - 1)];
+    int i;
+
+    for (i = 0; i < ADMIT_PROBES; i++) {
+	p = &shm->peaks[(key + i) & (ADMIT_HISTORY - 1)];
+	if (p->key == key) {
+	    if (peak < p->peak)
+		peak = (p->peak + peak) / 2;
+	    slot = p;
+	    break;
+	}
+	if (!p->key) {
+	    slot = p;
+	    break;
+	}
+    }
+    slot->key = key;
+    slot->peak = peak;
+}
+
+static void
+admit_acquire(struct syncsh_job *j)
+{
+    struct budget_slot *b;
+    int64_t budget, dflt, need, used, t;
+    uint64_t key;
+    useconds_t nap = 500;
+    int i, slot;
+
+    if (!admit_limits(&budget, &dflt) || !shm_attach(j->syncfd))
+	return;
+    key = admit_key(j->recipe);
+    t = now_us();
+    for (;;) {
+	shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+	slot = -1;
+	used = 0;
+	for (i = 0; i < ADMIT_SLOTS; i++) {
+	    b = &shm->admit[i];
+	    if (b->pid && !pid_alive(b->pid)) {
+		b->bytes = 0;
+		b->pid = 0;
+	    }
+	    if (b->pid)
+		used += b->bytes;
+	    else if (slot < 0)
+		slot = i;
+	}
+	if (!(need = admit_predict(key)))
+	    need = dflt;
+	if (need > budget)
+	    need = budget;
+	if (slot >= 0 && (!used || used + need <= budget)) {
+	    shm->admit[slot].pid = getpid();
+	    shm->admit[slot].bytes = need;
+	    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+	    break;
+	}
+	shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+	usleep(nap);
+	if (nap < 20000)
+	    nap *= 2;
+    }
+    j->admit_slot = slot;
+    j->stats.admitted = need;
+    j->stats.admitwait = now_us() - t;
+}
+
+/* Give back the reservation, and record the peak of a recipe that ran. */
+static void
+admit_release(struct syncsh_job *j, int ran)
+{
+    int64_t peak = (int64_t) j->stats.ru.ru_maxrss * 1024;
+
+    if (j->stats.cgmem > peak)
+	peak = j->stats.cgmem;
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    shm->admit[j->admit_slot].bytes = 0;
+    shm->admit[j->admit_slot].pid = 0;
+    if (ran && peak > 0)
+	admit_record(admit_key(j->recipe), peak);
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+    j->admit_slot = -1;
+}
+
+/*
+ * The compressed capture arena, SYNCSH_CAPTURE=compress[:<size>].
+ * A spawned recipe writes into pipes instead of files, drained by a
+ * reader thread into a list of chunks. Once a stream has captured
+ * more than <size> (default 1M) each chunk is compressed as it fills,
+ * so a recipe spewing megabytes of repetitive logs holds a fraction
+ * of that while it runs and while it waits for the output lock.
+ * Under the lock the chunks are decompressed one at a time as they
+ * are written out. When the result has to outlive the job (for the
+ * cache or coalesced waiters) it's expanded into the capture files.
+ */
+#define CHUNK_SIZE	65536
+#define LINES_TAG	64		/* widest SYNCSH_LINES tag */
+#define LINES_BUF	(2 * CHUNK_SIZE + LINES_TAG + 8)
+#define LZ_HASHLOG	12
+#define LZ_MINMATCH	4
+#define LZ_MFLIMIT	12		/* no match may start this near the end */
+#define LZ_LASTLITERALS	5		/* nor end this near */
+
+struct chunk {
+    struct chunk *next;
+    uint32_t len;		/* raw length */
+    uint32_t clen;		/* compressed length, or 0 if stored raw */
+    unsigned char data[];
+};
+
+struct arena {
+    int fd;			/* read end of the recipe's pipe, or -1 */
+    struct chunk *head, **tail;
+    int64_t raw, held;		/* bytes captured, bytes kept */
+    size_t fill;
+    size_t sent;		/* SYNCSH_LINES: of buf, written out */
+    char *hold;			/* start of a line from a sealed buffer */
+    size_t nhold;
+    int midline;		/* a line too long to hold went out in part */
+    unsigned char buf[CHUNK_SIZE];
+};
+
+struct arena_reader {
+    struct arena *a[2];		/* stdout, stderr */
+    int wfd[2];			/* the recipe's ends of the pipes */
+    int wake[2];		/* pipe to stop the thread */
+    int file[2];		/* the capture files, to spill to */
+    long long threshold;
+    int64_t limit;		/* SYNCSH_MEMBUDGET, or 0 */
+    int slot;			/* in the shared budget */
+    int64_t peak;		/* build-wide usage seen */
+    int spilled;
+    pthread_t thread;
+    int running;
+    char *linebuf;		/* SYNCSH_LINES batch, or NULL */
+    char tag[LINES_TAG + 4];
+    size_t ntag;
+    struct syncsh_job *job;	/* whose output lock to take */
+    struct flock fl;
+};
+
+struct arena_cursor {
+    struct chunk *c;		/* where a stalled sink stopped */
+    size_t off;
+};
+
+static uint32_t
+lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *
+lz_length(unsigned char *op, size_t n)
+{
+    for (; n >= 255; n -= 255)
+	*op++ = 255;
+    *op++ = n;
+
+    return op;
+}
+
+/*
+ * Compress 'n' bytes into the LZ4 block format: a greedy single-probe
+ * matcher, which is all a chunk of build output needs. Returns the
+ * compressed size, or 0 if it wouldn't fit in 'cap' bytes.
+ */
+static size_t
+lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASHLOG];
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    const unsigned char *ref, *m, *r;
+    unsigned char *op = dst, *oend = dst + cap, *token;
+    size_t lit, mlen;
+    uint32_t seq, h;
+
+    memset(table, 0, sizeof(table));
+    if (n > LZ_MFLIMIT) {
+	for (ip++; ip < end - LZ_MFLIMIT;) {
+	    seq = lz_read32(ip);
+	    h = (seq * 2654435761U) >> (32 - LZ_HASHLOG);
+	    ref = src + table[h];
+	    table[h] = ip - src;
+	    if (ref >= ip || ip - ref > 65535 || lz_read32(ref) != seq) {
+		ip++;
+		continue;
+	    }
+	    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+		ip--;
+		ref--;
+	    }
+	    for (m = ip + LZ_MINMATCH, r = ref + LZ_MINMATCH;
+		 m < end - LZ_LASTLITERALS && *m == *r; m++, r++)
+		continue;
+	    lit = ip - anchor;
+	    mlen = m - ip - LZ_MINMATCH;
+	    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+		return 0;
+	    token = op++;
+	    *token = (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15);
+	    if (lit >= 15)
+		op = lz_length(op, lit - 15);
+	    memcpy(op, anchor, lit);
+	    op += lit;
+	    *op++ = (ip - ref) & 0xff;
+	    *op++ = (ip - ref) >> 8;
+	    if (mlen >= 15)
+		op = lz_length(op, mlen - 15);
+	    ip = anchor = m;
+	}
+    }
+
+    lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+	return 0;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+	op = lz_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+/* The inverse, checking every length. Returns -1 on corrupt input. */
+static ssize_t
+lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t lit, mlen, off;
+    unsigned token, b;
+
+    while (ip < iend) {
+	token = *ip++;
+	if ((lit = token >> 4) == 15) {
+	    do {
+		if (ip >= iend)
+		    return -1;
+		lit += b = *ip++;
+	    } while (b == 255);
+	}
+	if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+	    return -1;
+	memcpy(op, ip, lit);
+	op += lit;
+	ip += lit;
+	if (ip == iend)
+	    break;		/* the last sequence has no match */
+
+	if (iend - ip < 2)
+	    return -1;
+	off = ip[0] | ip[1] << 8;
+	ip += 2;
+	if (!off || off > (size_t)(op - dst))
+	    return -1;
+	if ((mlen = token & 15) == 15) {
+	    do {
+		if (ip >= iend)
+		    return -1;
+		mlen += b = *ip++;
+	    } while (b == 255);
+	}
+	mlen += LZ_MINMATCH;
+	if (mlen > (size_t)(oend - op))
+	    return -1;
+	for (; mlen; mlen--, op++)	/* may overlap, so bytewise */
+	    *op = op[-off];
+    }
+
+    return op - dst;
+}
+
+/*
+ * The compress threshold, or -1 if the arena isn't in use. Under a
+ * memory budget, memory captures use it too (compressing only when
+ * the budget is tight) so they can be accounted for.
+ */
+static long long
+arena_threshold(void)
+{
+    char *mode = getenv(PFX "CAPTURE");
+    long long n;
+
+    if (mode && !strcmp(mode, "memory") && getenv(PFX "MEMBUDGET"))
+	return LLONG_MAX;
+    if (!mode || strncmp(mode, "compress", 8) || (mode[8] && mode[8] != ':'))
+	return -1;
+    if (mode[8] && (n = parse_size(mode + 9)) >= 0)
+	return n;
+
+    return 1 << 20;
+}
+
+static struct arena *
+arena_new(int fd)
+{
+    struct arena *a;
+
+    if (!(a = malloc(sizeof(*a))))
+	return NULL;
+    a->fd = fd;
+    a->head = NULL;
+    a->tail = &a->head;
+    a->raw = a->held = 0;
+    a->fill = 0;
+    a->sent = 0;
+    a->hold = NULL;
+    a->nhold = 0;
+    a->midline = 0;
+
+    return a;
+}
+
+static void
+arena_free(struct arena *a)
+{
+    struct chunk *c;
+
+    if (!a)
+	return;
+    while ((c = a->head)) {
+	a->head = c->next;
+	free(c);
+    }
+    if (a->fd != -1)
+	close(a->fd);
+    free(a->hold);
+    free(a);
+}
+
+/* A chunk's raw bytes: in place, or decompressed into 'scratch'. */
+static const unsigned char *
+chunk_bytes(struct chunk *c, unsigned char *scratch)
+{
+    if (!c->clen)
+	return c->data;
+    if (lz_decompress(c->data, c->clen, scratch, CHUNK_SIZE) != (ssize_t) c->len) {
+	fprintf(stderr, "%s: Error: corrupt capture chunk\n", prog);
+	memset(scratch, '?', c->len);
+    }
+
+    return scratch;
+}
+
+static int
+write_all(int fd, const void *p, size_t n)
+{
+    ssize_t nw;
+
+    for (; n; n -= nw, p = (const char *)p + nw) {
+	EINTR_CHECK(nw, write(fd, p, n));
+	if (nw <= 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* Write a stream's chunks from 'cur' on to 'fd'. */
+static int
+arena_write(struct arena_cursor *cur, int fd, unsigned char *scratch)
+{
+    struct chunk *c;
+    size_t off = cur->off;
+
+    for (c = cur->c; c; c = c->next, off = 0)
+	if (write_all(fd, chunk_bytes(c, scratch) + off, c->len - off))
+	    return -1;
+
+    return 0;
+}
+
+/*
+ * Out of budget: write both streams' chunks to the capture files and
+ * let go of them. Everything after goes straight to the files too.
+ */
+static void
+arena_spill(struct arena_reader *rd, unsigned char *scratch)
+{
+    struct arena_cursor cur;
+    struct chunk *c;
+    struct arena *a;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	a = rd->a[i];
+	cur.c = a->head;
+	cur.off = 0;
+	if (arena_write(&cur, rd->file[i], scratch))
+	    syserr(0, "capture spill");
+	while ((c = a->head)) {
+	    a->head = c->next;
+	    free(c);
+	}
+	a->tail = &a->head;
+	a->held = 0;
+    }
+    rd->peak = budget_release(rd->slot, 0);
+    rd->spilled = 1;
+    if (getenv(PFX "DEBUG"))
+	fprintf(stderr, "%s: capture budget exhausted, spilling to disk\n", prog);
+}
+
+/* Move the filled buffer to a chunk of its own, compressed if worthwhile. */
+static void
+arena_seal(struct arena_reader *rd, int i, unsigned char *scratch)
+{
+    struct arena *a = rd->a[i];
+    struct chunk *c;
+    size_t clen = 0, len;
+
+    if (!a->fill)
+	return;
+    a->raw += a->fill;
+    if (!rd->spilled) {
+	if (a->raw > rd->threshold || (rd->limit && budget_tight(rd->limit)))
+	    clen = lz_compress(a->buf, a->fill, scratch, a->fill - a->fill / 8);
+	len = clen ? clen : a->fill;
+	if (rd->limit && budget_reserve(rd->slot, rd->limit, len) == -1)
+	    arena_spill(rd, scratch);
+    }
+    if (rd->spilled) {
+	if (write_all(rd->file[i], a->buf, a->fill))
+	    syserr(0, "capture spill");
+	a->fill = 0;
+	return;
+    }
+
+    if (!(c = malloc(sizeof(*c) + len))) {
+	syserr(0, "malloc(arena)");
+	a->fill = 0;
+	return;
+    }
+    c->next = NULL;
+    c->len = a->fill;
+    c->clen = clen;
+    memcpy(c->data, clen ? scratch : a->buf, len);
+    *a->tail = c;
+    a->tail = &c->next;
+    a->held += len;
+    a->fill = 0;
+}
+
+/*
+ * Line mode, SYNCSH_LINES=[pid|<n>]. The reader thread writes each
+ * complete line to the real stdout or stderr as soon as it arrives,
+ * after a tag naming the recipe: syncsh's pid, or the first <n>
+ * characters of the recipe (none for 0). Lines read together go out
+ * together in one write(). One of PIPE_BUF bytes or less can't be torn
+ * so it takes no lock; a bigger one takes the output lock. A partial
+ * line waits for the rest, or for the recipe to exit, though one
+ * longer than a chunk goes out in pieces. Output is still captured
+ * for the tee, cache and coalesced waiters. There is no line mode
+ * with a lock broker, which only takes whole recipes.
+ */
+static void
+lines_tag(struct arena_reader *rd, const char *recipe, const char *spec)
+{
+    long n = 0;
+    char *end;
+
+    if (*spec && (n = strtol(spec, &end, 10)) >= 0 && !*end) {
+	if (n > LINES_TAG)
+	    n = LINES_TAG;
+	if (n)
+	    rd->ntag = snprintf(rd->tag, sizeof(rd->tag), "[%-*.*s] ", (int)n,
+				(int)strcspn(recipe, "\n") < n
+				? (int)strcspn(recipe, "\n") : (int)n, recipe);
+    } else {
+	rd->ntag = snprintf(rd->tag, sizeof(rd->tag), "[%ld] ", (long)getpid());
+    }
+}
+
+static void
+lines_write(struct arena_reader *rd, int i, const char *p, size_t n)
+{
+    int fd = i ? STDERR_FILENO : STDOUT_FILENO;
+    struct flock *fl = NULL;
+
+    if (!n)
+	return;
+    if (n > PIPE_BUF) {
+	pthread_mutex_lock(&output_mutex);
+	fl = acquire_semaphore(rd->job, &rd->fl, 0, 0);
+    }
+    if (write_all(fd, p, n))
+	syserr(0, "write(lines)");
+    if (n > PIPE_BUF) {
+	if (fl)
+	    release_semaphore(rd->job, fl);
+	pthread_mutex_unlock(&output_mutex);
+    }
+}
+
+/*
+ * Write the complete lines of a stream not yet written, or with
+ * 'final' all of it, a missing newline added.
+ */
+static void
+lines_emit(struct arena_reader *rd, int i, int final)
+{
+    struct arena *a = rd->a[i];
+    struct syncsh_line line[64];
+    const char *p = (char *)a->buf + a->sent, *end = (char *)a->buf + a->fill;
+    size_t k, nl, n = 0;
+    int whole;
+
+    while (p < end) {
+	nl = syncsh_scan_lines(p, end - p, line, 64);
+	for (k = 0; k < nl; k++) {
+	    whole = p[line[k].len - 1] == '\n';
+	    if (!whole && !final)
+		goto done;
+	    if (n + rd->ntag + a->nhold + line[k].len + 1 > LINES_BUF) {
+		lines_write(rd, i, rd->linebuf, n);
+		n = 0;
+	    }
+	    if (!a->midline) {
+		memcpy(rd->linebuf + n, rd->tag, rd->ntag);
+		n += rd->ntag;
+	    }
+	    memcpy(rd->linebuf + n, a->hold, a->nhold);
+	    n += a->nhold;
+	    memcpy(rd->linebuf + n, p, line[k].len);
+	    n += line[k].len;
+	    if (!whole)
+		rd->linebuf[n++] = '\n';
+	    a->nhold = 0;
+	    a->midline = 0;
+	    p += line[k].len;
+	}
+    }
+    if (final && a->nhold) {
+	if (n + rd->ntag + a->nhold + 1 > LINES_BUF) {
+	    lines_write(rd, i, rd->linebuf, n);
+	    n = 0;
+	}
+	if (!a->midline) {
+	    memcpy(rd->linebuf + n, rd->tag, rd->ntag);
+	    n += rd->ntag;
+	}
+	memcpy(rd->linebuf + n, a->hold, a->nhold);
+	n += a->nhold;
+	rd->linebuf[n++] = '\n';
+	a->nhold = 0;
+    }
+  done:
+    lines_write(rd, i, rd->linebuf, n);
+    a->sent = p - (char *)a->buf;
+}
+
+/* The buffer is about to be sealed: keep the start of its last line. */
+static void
+lines_hold(struct arena_reader *rd, int i)
+{
+    struct arena *a = rd->a[i];
+    size_t n = a->fill - a->sent, k = 0;
+    char *hold;
+
+    if (a->nhold + n > CHUNK_SIZE) {
+	/* Too long to wait for: out it goes as it is. */
+	if (!a->midline) {
+	    memcpy(rd->linebuf, rd->tag, rd->ntag);
+	    k = rd->ntag;
+	}
+	memcpy(rd->linebuf + k, a->hold, a->nhold);
+	lines_write(rd, i, rd->linebuf, k + a->nhold);
+	a->nhold = 0;
+	a->midline = 1;
+    }
+    if (n && (hold = realloc(a->hold, a->nhold + n))) {
+	memcpy(hold + a->nhold, a->buf + a->sent, n);
+	a->hold = hold;
+	a->nhold += n;
+    }
+    a->sent = 0;
+}
+
+/*
+ * The reader thread. It runs until the recipe closes both pipes or,
+ * once the recipe has exited, it's told to stop: a backgrounded
+ * grandchild may hold the pipes open indefinitely, so whatever is
+ * already in them is taken and the rest left behind.
+ */
+static void *
+arena_read(void *arg)
+{
+    struct arena_reader *rd = arg;
+    unsigned char *scratch = malloc(CHUNK_SIZE);
+    struct pollfd pfd[3];
+    struct arena *a;
+    int stopping = 0, i;
+    ssize_t n;
+    char c;
+
+    if (!scratch)
+	return NULL;
+    while (rd->a[0]->fd != -1 || rd->a[1]->fd != -1) {
+	for (i = 0; i < 2; i++) {
+	    pfd[i].fd = rd->a[i]->fd;
+	    pfd[i].events = POLLIN;
+	}
+	pfd[2].fd = stopping ? -1 : rd->wake[0];
+	pfd[2].events = POLLIN;
+	if (poll(pfd, 3, stopping ? 0 : -1) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (pfd[2].revents) {
+	    stopping = 1;
+	    EINTR_CHECK(n, read(rd->wake[0], &c, 1));
+	    for (i = 0; i < 2; i++)
+		if (rd->a[i]->fd != -1)
+		    fcntl(rd->a[i]->fd, F_SETFL, O_NONBLOCK);
+	}
+	for (i = 0; i < 2; i++) {
+	    a = rd->a[i];
+	    if (a->fd == -1 || (!pfd[i].revents && !stopping))
+		continue;
+	    EINTR_CHECK(n, read(a->fd, a->buf + a->fill, CHUNK_SIZE - a->fill));
+	    if (n > 0) {
+		a->fill += n;
+		if (rd->linebuf)
+		    lines_emit(rd, i, 0);
+		if (a->fill == CHUNK_SIZE) {
+		    if (rd->linebuf)
+			lines_hold(rd, i);
+		    arena_seal(rd, i, scratch);
+		}
+	    } else if (n == 0 || errno != EAGAIN || stopping) {
+		close(a->fd);
+		a->fd = -1;
+	    }
+	}
+    }
+    for (i = 0; i < 2; i++) {
+	if (rd->linebuf)
+	    lines_emit(rd, i, 1);
+	arena_seal(rd, i, scratch);
+    }
+    free(scratch);
+
+    return NULL;
+}
+
+static int
+pipe_cloexec(int fds[2])
+{
+    if (pipe(fds) == -1)
+	return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    return 0;
+}
+
+/*
+ * Anything already written to a capture file (syncsh's verbose command
+ * line) goes into the arena first. Returns -1 if there's too much.
+ */
+static int
+arena_adopt(struct arena *a, FILE *fp)
+{
+    ssize_t n;
+
+    EINTR_CHECK(n, pread(fileno(fp), a->buf, CHUNK_SIZE, 0));
+    if (n < 0 || n == CHUNK_SIZE)
+	return -1;
+    a->fill = n;
+
+    return 0;
+}
+
+/* The recipe has its ends of the pipes, so let go of ours. */
+static void
+arena_detach(struct arena_reader *rd)
+{
+    if (rd->wfd[0] != -1)
+	close(rd->wfd[0]);
+    if (rd->wfd[1] != -1)
+	close(rd->wfd[1]);
+    rd->wfd[0] = rd->wfd[1] = -1;
+}
+
+/* Once the recipe has exited, collect what's left and stop the thread. */
+static void
+arena_stop(struct arena_reader *rd)
+{
+    ssize_t n;
+
+    if (!rd->running)
+	return;
+    EINTR_CHECK(n, write(rd->wake[1], "", 1));
+    pthread_join(rd->thread, NULL);
+    rd->running = 0;
+}
+
+/* Free the arena. Returns the build-wide peak, or -1 without a budget. */
+static int64_t
+arena_release(struct arena_reader *rd)
+{
+    int64_t peak = -1;
+    int i;
+
+    /* If abandoned with the recipe still going, just take what's there. */
+    arena_detach(rd);
+    arena_stop(rd);
+    if (rd->limit) {
+	peak = budget_release(rd->slot, 1);
+	if (rd->peak > peak)
+	    peak = rd->peak;
+    }
+    for (i = 0; i < 2; i++) {
+	if (rd->wake[i] != -1)
+	    close(rd->wake[i]);
+	arena_free(rd->a[i]);
+    }
+    free(rd->linebuf);
+    free(rd);
+
+    return peak;
+}
+
+/* Set up the pipes and start the reader; NULL to capture to the files. */
+static struct arena_reader *
+arena_start(struct syncsh_job *j, long long threshold)
+{
+    struct arena_reader *rd;
+    int out[2] = { -1, -1 }, err[2] = { -1, -1 };
+    char *budget = getenv(PFX "MEMBUDGET");
+    long long limit = budget ? parse_size(budget) : 0;
+    int slot = -1;
+
+    /* With no room in the budget's table, capture to the files. */
+    if (limit > 0 && (!shm_attach(j->syncfd) || (slot = budget_claim()) < 0))
+	return NULL;
+    if (!(rd = calloc(1, sizeof(*rd)))) {
+	if (slot >= 0)
+	    budget_release(slot, 1);
+	return NULL;
+    }
+    rd->wfd[0] = rd->wfd[1] = rd->wake[0] = rd->wake[1] = -1;
+    rd->file[0] = fileno(j->out);
+    rd->file[1] = fileno(j->err);
+    rd->threshold = threshold;
+    rd->limit = limit > 0 ? limit : 0;
+    rd->slot = slot;
+    rd->job = j;
+    if (j->lines && (rd->linebuf = malloc(LINES_BUF)))
+	lines_tag(rd, j->recipe, getenv(PFX "LINES"));
+    if (pipe_cloexec(out) == -1 || pipe_cloexec(err) == -1
+	|| pipe_cloexec(rd->wake) == -1) {
+	syserr(0, "pipe");
+	close(out[0]);
+	close(out[1]);
+	close(err[0]);
+	close(err[1]);
+	arena_release(rd);
+	return NULL;
+    }
+    rd->wfd[0] = out[1];
+    rd->wfd[1] = err[1];
+    if (!(rd->a[0] = arena_new(out[0])) || !(rd->a[1] = arena_new(err[0]))) {
+	if (!rd->a[0])
+	    close(out[0]);
+	close(err[0]);
+	arena_release(rd);
+	return NULL;
+    }
+    if (arena_adopt(rd->a[0], j->out) || arena_adopt(rd->a[1], j->err)
+	|| ftruncate(fileno(j->out), 0) == -1 || ftruncate(fileno(j->err), 0) == -1
+	|| lseek(fileno(j->out), 0, SEEK_SET) == -1
+	|| lseek(fileno(j->err), 0, SEEK_SET) == -1
+	|| (errno = pthread_create(&rd->thread, NULL, arena_read, rd))) {
+	syserr(0, "capture arena");
+	arena_release(rd);
+	return NULL;
+    }
+    rd->running = 1;
+
+    return rd;
+}
+
+/* Decompress the whole capture into the capture files. */
+static int
+arena_expand(struct arena_reader *rd, FILE *out, FILE *err)
+{
+    unsigned char *scratch = malloc(CHUNK_SIZE);
+    struct arena_cursor cur;
+    int rc = -1;
+
+    if (scratch) {
+	cur.c = rd->a[0]->head;
+	cur.off = 0;
+	if (!arena_write(&cur, fileno(out), scratch)) {
+	    cur.c = rd->a[1]->head;
+	    rc = arena_write(&cur, fileno(err), scratch);
+	}
+	free(scratch);
+    }
+    if (rc)
+	syserr(0, "capture arena");
+
+    return rc;
+}
+
+/*
+ * CPU pinning. With SYNCSH_PIN set, each recipe is confined (along
+ * with everything it spawns) to one cache domain: the CPUs sharing
+ * an L3 cache within a single NUMA node. The domains are read from
+ * /sys once per build and kept in the shared state, where a slot per
+ * running recipe records which domain it was given; new recipes go
+ * to the domain with the fewest running recipes per CPU.
+ */
+#ifdef __linux__
+static int
+read_file(const char *path, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+	return -1;
+    EINTR_CHECK(n, read(fd, buf, size - 1));
+    close(fd);
+    if (n < 0)
+	return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+
+    return n;
+}
+
+/* Parse a kernel cpu list such as "0-3,8-11" into a cpu set. */
+static int
+parse_cpulist(const char *list, cpu_set_t *set)
+{
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*list) {
+	lo = hi = strtol(list, &end, 10);
+	if (end == list)
+	    return -1;
+	if (*end == '-')
+	    hi = strtol(end + 1, &end, 10);
+	for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+	    CPU_SET(lo, set);
+	list = *end == ',' ? end + 1 : end;
+	if (*end && *end != ',')
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* The set of CPUs sharing the last-level (L3) cache with 'cpu'. */
+static int
+cpu_l3(int cpu, cpu_set_t *set)
+{
+    char path[128], buf[1024];
+    int i;
+
+    for (i = 0; i < 10; i++) {
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+	if (read_file(path, buf, sizeof(buf)) == -1)
+	    break;
+	if (strcmp(buf, "3"))
+	    continue;
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+		 cpu, i);
+	if (read_file(path, buf, sizeof(buf)) != -1)
+	    return parse_cpulist(buf, set);
+    }
+    snprintf(path, sizeof(path),
+	     "/sys/devices/system/cpu/cpu%d/topology/core_siblings_list", cpu);
+    if (read_file(path, buf, sizeof(buf)) != -1)
+	return parse_cpulist(buf, set);
+
+    return -1;
+}
+
+/* The NUMA node of 'cpu', narrowing 'set' to that node's CPUs. */
+static int
+cpu_node(int cpu, cpu_set_t *set)
+{
+    char path[128], buf[4096];
+    struct dirent *de;
+    cpu_set_t node;
+    DIR *dp;
+    int n = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if (!(dp = opendir(path)))
+	return -1;
+    while ((de = readdir(dp))) {
+	if (!strncmp(de->d_name, "node", 4) && isdigit((unsigned char)de->d_name[4])) {
+	    n = atoi(de->d_name + 4);
+	    break;
+	}
+    }
+    closedir(dp);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (n >= 0 && read_file(path, buf, sizeof(buf)) != -1
+	&& !parse_cpulist(buf, &node))
+	CPU_AND(set, set, &node);
+
+    return n;
+}
+
+static int
+pin_topology(struct pindomain *dom, int max)
+{
+    cpu_set_t allowed, set;
+    int cpu, i, n = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+	return 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (!CPU_ISSET(cpu, &allowed))
+	    continue;
+	for (i = 0; i < n; i++)
+	    if (CPU_ISSET(cpu, &dom[i].cpus))
+		break;
+	if (i < n)
+	    continue;
+	if (cpu_l3(cpu, &set) == -1) {
+	    CPU_ZERO(&set);
+	    CPU_SET(cpu, &set);
+	}
+	dom[n].node = cpu_node(cpu, &set);
+	CPU_AND(&set, &set, &allowed);
+	CPU_SET(cpu, &set);
+	dom[n].cpus = set;
+	dom[n].ncpus = CPU_COUNT(&set);
+	if (++n == max)
+	    break;
+    }
+
+    return n;
+}
+
+static int
+pin_acquire(struct syncsh_job *j)
+{
+    int load[PIN_DOMAINS] = { 0 };
+    int i, best = -1, slot = -1;
+
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    if (!shm->ndomains && !(shm->ndomains = pin_topology(shm->domains,
+							  PIN_DOMAINS)))
+	shm->ndomains = -1;
+    if (shm->ndomains > 1) {
+	for (i = 0; i < PIN_SLOTS; i++) {
+	    if (shm->pins[i].pid && !pid_alive(shm->pins[i].pid))
+		shm->pins[i].pid = 0;
+	    if (shm->pins[i].pid)
+		load[shm->pins[i].domain]++;
+	    else if (slot < 0)
+		slot = i;
+	}
+	for (i = 0; i < shm->ndomains; i++) {
+	    if (best < 0 || load[i] * shm->domains[best].ncpus
+		< load[best] * shm->domains[i].ncpus)
+		best = i;
+	}
+    }
+    if (slot >= 0 && best >= 0) {
+	shm->pins[slot].pid = getpid();
+	shm->pins[slot].domain = best;
+	j->pinset = shm->domains[best].cpus;
+	j->pin_slot = slot;
+	if (getenv(PFX "DEBUG"))
+	    fprintf(stderr, "%s: pinned to domain %d (node %d, %d cpus) for '%s'\n",
+		    prog, best, shm->domains[best].node,
+		    shm->domains[best].ncpus, j->recipe);
+    }
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+
+    return j->pin_slot;
+}
+
+static void
+pin_release(struct syncsh_job *j)
+{
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    shm->pins[j->pin_slot].pid = 0;
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+    j->pin_slot = -1;
+}
+/*
+ * Per-recipe cgroups. With SYNCSH_CGROUP set and a cgroup v2
+ * hierarchy, each recipe runs in its own child cgroup so that its
+ * whole process tree can be accounted (including page cache, which
+ * rusage misses) and optionally throttled with the class's memhigh
+ * and cpuweight attributes. SYNCSH_CGROUP may name the parent
+ * cgroup directory; otherwise our own cgroup is used. Without cgroup
+ * v2 the recipe runs as usual; a parent whose controllers can't be
+ * enabled is an error, and the recipe then runs as usual too.
+ */
+static unsigned cgseq;
+
+static int
+cgroup_write(struct syncsh_job *j, const char *file, const char *val)
+{
+    char path[PATH_MAX + 32];
+    int fd, rc;
+
+    snprintf(path, sizeof(path), "%s/%s", j->cgdir, file);
+    if ((fd = open(path, O_WRONLY)) == -1)
+	return -1;
+    rc = write(fd, val, strlen(val)) == (ssize_t) strlen(val) ? 0 : -1;
+    close(fd);
+
+    return rc;
+}
+
+static int
+cgroup_read(struct syncsh_job *j, const char *file, char *buf, size_t size)
+{
+    char path[PATH_MAX + 32];
+
+    snprintf(path, sizeof(path), "%s/%s", j->cgdir, file);
+
+    return read_file(path, buf, size);
+}
+
+/* Sum the values of every "<key>=<n>" or "<key> <n>" in 'buf'. */
+static long long
+cgroup_sum(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+    long long sum = 0;
+    const char *p;
+
+    for (p = buf; (p = strstr(p, key)); p += len) {
+	if ((p == buf || isspace((unsigned char)p[-1]))
+	    && (p[len] == '=' || p[len] == ' '))
+	    sum += atoll(p + len + 1);
+    }
+
+    return sum;
+}
+
+/* Whether the space-separated 'list' has 'name'. */
+static int
+cgroup_has(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    for (p = list; (p = strstr(p, name)); p += len)
+	if ((p == list || isspace((unsigned char)p[-1]))
+	    && (!p[len] || isspace((unsigned char)p[len])))
+	    return 1;
+
+    return 0;
+}
+
+/*
+ * A controller's files only appear in the children of a cgroup which
+ * enables it in cgroup.subtree_control, and cgroup v2 only allows
+ * that in a cgroup with no processes of its own. Enable memory (which
+ * memory.peak and memory.high need), cpu and io where offered.
+ */
+static int
+cgroup_enable(const char *parent)
+{
+    static const char *const want[] = { "memory", "cpu", "io" };
+    char path[PATH_MAX], have[1024], on[1024], buf[64];
+    unsigned i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", parent);
+    if (read_file(path, have, sizeof(have)) < 0)
+	return -1;
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent);
+    if (read_file(path, on, sizeof(on)) < 0)
+	*on = '\0';
+    if (!cgroup_has(have, "memory")) {
+	fprintf(stderr, "%s: Error: no memory controller delegated to %s\n",
+		prog, parent);
+	return -1;
+    }
+    for (i = 0; i < sizeof(want) / sizeof(want[0]); i++) {
+	if (!cgroup_has(have, want[i]) || cgroup_has(on, want[i]))
+	    continue;
+	snprintf(buf, sizeof(buf), "+%s", want[i]);
+	if ((fd = open(path, O_WRONLY)) == -1
+	    || write(fd, buf, strlen(buf)) != (ssize_t) strlen(buf)) {
+	    fprintf(stderr, "%s: Error: can't enable %s in %s: %s"
+		    " (SYNCSH_CGROUP should name a delegated cgroup with"
+		    " no processes in it)\n", prog, want[i], path,
+		    strerror(errno));
+	    if (fd != -1)
+		close(fd);
+	    return -1;
+	}
+	close(fd);
+    }
+
+    return 0;
+}
+
+static int
+cgroup_create(struct syncsh_job *j, const char *spec)
+{
+    char parent[PATH_MAX - 64], buf[PATH_MAX];
+    FILE *fp;
+
+    if (is_absolute(spec)) {
+	snprintf(parent, sizeof(parent), "%s", spec);
+    } else {
+	*parent = '\0';
+	if (!(fp = fopen("/proc/self/cgroup", "r")))
+	    return -1;
+	while (fgets(buf, sizeof(buf), fp)) {
+	    if (!strncmp(buf, "0::", 3)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		if (snprintf(parent, sizeof(parent), "/sys/fs/cgroup%s", buf + 3)
+		    >= (int)sizeof(parent))
+		    *parent = '\0';
+		break;
+	    }
+	}
+	fclose(fp);
+    }
+
+    snprintf(j->cgdir, sizeof(j->cgdir), "%s/cgroup.controllers", parent);
+    if (!*parent || access(j->cgdir, F_OK) == -1 || cgroup_enable(parent)) {
+	*j->cgdir = '\0';
+	return -1;
+    }
+    /* A driver may run several jobs at once, each with its own. */
+    snprintf(j->cgdir, sizeof(j->cgdir), "%s/syncsh-%ld-%u", parent,
+	     (long)getpid(), __sync_fetch_and_add(&cgseq, 1));
+    if (mkdir(j->cgdir, 0755) == -1) {
+	*j->cgdir = '\0';
+	return -1;
+    }
+
+    if (j->cls && j->cls->memhigh) {
+	snprintf(buf, sizeof(buf), "%lld\n", j->cls->memhigh);
+	cgroup_write(j, "memory.high", buf);
+    }
+    if (j->cls && j->cls->cpuweight) {
+	snprintf(buf, sizeof(buf), "%d\n", j->cls->cpuweight);
+	cgroup_write(j, "cpu.weight", buf);
+    }
+
+    return 0;
+}
+
+static void
+cgroup_collect(struct syncsh_job *j)
+{
+    char buf[8192];
+
+    if (cgroup_read(j, "memory.peak", buf, sizeof(buf)) > 0)
+	j->stats.cgmem = atoll(buf);
+    if (cgroup_read(j, "cpu.stat", buf, sizeof(buf)) > 0)
+	j->stats.cgcpu = cgroup_sum(buf, "usage_usec");
+    if (cgroup_read(j, "io.stat", buf, sizeof(buf)) > 0) {
+	j->stats.cgread = cgroup_sum(buf, "rbytes");
+	j->stats.cgwrite = cgroup_sum(buf, "wbytes");
+    }
+    j->stats.cgroup = 1;
+
+    /* This fails harmlessly if stray processes are still inside. */
+    rmdir(j->cgdir);
+    *j->cgdir = '\0';
+}
+
+/*
+ * Process-tree accounting. With SYNCSH_PROCS set we become a child
+ * subreaper and, while the recipe runs, poll /proc every SYNCSH_PROCS
+ * milliseconds (default 20) for the recipe's descendants, noting what
+ * each one exec'd and how much CPU and memory it used. Orphans are
+ * reparented to us, so when we reap those the figures are exact;
+ * for the rest they are as of the last poll. Strays still running in
+ * our session when the shell exits (typically forgotten background
+ * jobs) are killed and reaped so they can't outlive the recipe; those
+ * which have called setsid() are assumed to be daemons and left alone.
+ * Descendant discovery needs /proc/<pid>/task/<tid>/children.
+ */
+#define MAX_PROCS	512
+
+struct proc {
+    pid_t pid;
+    unsigned long long start;	/* kernel start time, to spot pid reuse */
+    int64_t first, last;	/* when first and last seen, usec */
+    long long utime, stime;	/* usec */
+    long rss;			/* peak resident KB seen */
+    int reaped;			/* figures are exact, from wait4() */
+    int stray;			/* still running after the shell exited */
+    char comm[16];
+    char cmd[256];
+};
+
+static void
+procs_cmdline(struct proc *p)
+{
+    char path[64];
+    int n, i;
+
+    snprintf(path, sizeof(path), "/proc/%ld/cmdline", (long)p->pid);
+    if ((n = read_file(path, p->cmd, sizeof(p->cmd))) <= 0) {
+	snprintf(p->cmd, sizeof(p->cmd), "%s", p->comm);
+	return;
+    }
+    /* read_file() stopped at a newline; the arguments are NUL-separated */
+    for (i = 0; i < n - 1; i++)
+	if (p->cmd[i] == '\0' || p->cmd[i] == '\n')
+	    p->cmd[i] = ' ';
+    p->cmd[n] = '\0';
+    while (n > 0 && p->cmd[n - 1] == ' ')
+	p->cmd[--n] = '\0';
+}
+
+static struct proc *
+procs_update(struct syncsh_job *j, pid_t pid, int64_t now)
+{
+    static long tck, pagekb;
+    char path[64], buf[1024], comm[16], *p, *end;
+    unsigned long long f[22];
+    struct proc *pp = NULL;
+    size_t len;
+    int i;
+
+    if (!tck) {
+	tck = sysconf(_SC_CLK_TCK);
+	pagekb = sysconf(_SC_PAGESIZE) / 1024;
+    }
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+    if (read_file(path, buf, sizeof(buf)) <= 0
+	|| !(p = strchr(buf, '(')) || !(end = strrchr(buf, ')')))
+	return NULL;
+    len = end - p - 1;
+    if (len >= sizeof(comm))
+	len = sizeof(comm) - 1;
+    memcpy(comm, p + 1, len);
+    comm[len] = '\0';
+
+    /* f[0] is field 4 (ppid) of proc(5); skip the state letter */
+    for (p = end + 3, i = 0; i < 22; i++, p = end)
+	f[i] = strtoull(p, &end, 10);
+
+    for (i = j->nprocs - 1; i >= 0; i--) {
+	if (j->procs[i].pid == pid && j->procs[i].start == f[18]) {
+	    pp = &j->procs[i];
+	    break;
+	}
+    }
+    if (!pp) {
+	if (j->nprocs == MAX_PROCS)
+	    return NULL;
+	pp = &j->procs[j->nprocs++];
+	memset(pp, 0, sizeof(*pp));
+	pp->pid = pid;
+	pp->start = f[18];
+	pp->first = now;
+    }
+    if (pp->reaped)
+	return pp;
+    if (strcmp(pp->comm, comm)) {
+	/* New, or it has exec'd since we last looked. */
+	memcpy(pp->comm, comm, sizeof(comm));
+	procs_cmdline(pp);
+    }
+    pp->last = now;
+    pp->utime = f[10] * 1000000 / tck;
+    pp->stime = f[11] * 1000000 / tck;
+    if ((long)f[20] * pagekb > pp->rss)
+	pp->rss = f[20] * pagekb;
+
+    return pp;
+}
+
+/* Record 'pid' and its descendants, calling 'fn' on each if given. */
+static void
+procs_visit(struct syncsh_job *j, pid_t pid, int64_t now,
+	    void (*fn)(struct proc *))
+{
+    char path[64], buf[4096], *p, *end;
+    struct proc *pp;
+    pid_t kid;
+
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld/children",
+	     (long)pid, (long)pid);
+    if (read_file(path, buf, sizeof(buf)) == -1)
+	return;
+    for (p = buf;; p = end) {
+	kid = strtol(p, &end, 10);
+	if (end == p)
+	    break;
+	if ((pp = procs_update(j, kid, now)) && fn)
+	    fn(pp);
+	procs_visit(j, kid, now, fn);
+    }
+}
+
+static void
+procs_reaped(struct syncsh_job *j, pid_t pid, const struct rusage *ru,
+	     int64_t now)
+{
+    int i;
+
+    for (i = j->nprocs - 1; i >= 0; i--) {
+	if (j->procs[i].pid == pid && !j->procs[i].reaped) {
+	    j->procs[i].utime = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+	    j->procs[i].stime = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+	    j->procs[i].rss = ru->ru_maxrss;
+	    j->procs[i].last = now;
+	    j->procs[i].reaped = 1;
+	    return;
+	}
+    }
+}
+
+/* Reap whatever is ready; returns 1 once 'child' has been reaped. */
+static int
+procs_reap(struct syncsh_job *j, pid_t child, int *status,
+	   struct rusage *ru)
+{
+    struct rusage r;
+    pid_t pid;
+    int st, done = 0;
+
+    while ((pid = wait4(-1, &st, WNOHANG, &r)) > 0) {
+	if (pid == child) {
+	    *status = st;
+	    *ru = r;
+	    done = 1;
+	}
+	procs_reaped(j, pid, &r, now_us());
+    }
+
+    return done;
+}
+
+static void
+procs_mark_stray(struct proc *p)
+{
+    if (getsid(p->pid) == getsid(0))
+	p->stray = 1;
+}
+
+static void
+procs_wait(struct syncsh_job *j)
+{
+    struct timespec ts;
+    sigset_t set;
+    char *interval = getenv(PFX "PROCS");
+    long ms = atol(interval);
+    int i, round, left, tries;
+
+    if (ms <= 0)
+	ms = 20;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    while (!procs_reap(j, j->child, &j->status, &j->stats.ru)) {
+	procs_visit(j, getpid(), now_us(), NULL);
+	sigtimedwait(&set, NULL, &ts);
+    }
+
+    /* Anything still below us now is a stray. */
+    procs_visit(j, getpid(), now_us(), procs_mark_stray);
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100000000;
+    for (round = 0; round < 2; round++) {
+	for (i = left = 0; i < j->nprocs; i++) {
+	    if (!j->procs[i].stray || j->procs[i].reaped)
+		continue;
+	    if (!round && j->err)
+		fprintf(j->err, "%s: killing stray process %ld (%s)\n", prog,
+			(long)j->procs[i].pid, j->procs[i].cmd);
+	    kill(j->procs[i].pid, round ? SIGKILL : SIGTERM);
+	    left++;
+	}
+	/* Give them a second to go quietly before using SIGKILL. */
+	for (tries = 0; left && tries < 10; tries++) {
+	    sigtimedwait(&set, NULL, &ts);
+	    procs_reap(j, 0, &j->status, &j->stats.ru);
+	    for (i = left = 0; i < j->nprocs; i++)
+		left += j->procs[i].stray && !j->procs[i].reaped;
+	}
+    }
+    if (j->err)
+	fflush(j->err);
+}
+
+/* Write a "ty=cmd" stats record for each command seen. */
+static void
+procs_record(struct syncsh_job *j, int fd)
+{
+    char rec[PIPE_BUF];
+    size_t n;
+    int i;
+
+    for (i = 0; i < j->nprocs; i++) {
+	n = snprintf(rec, sizeof(rec),
+		     "v=1\tty=cmd\tpid=%ld\tcp=%ld\tt0=%lld\tt1=%lld\tut=%lld"
+		     "\tkt=%lld\trss=%ld\tex=%d\tst=%d\tcmd=",
+		     (long)getpid(), (long)j->procs[i].pid,
+		     (long long)j->procs[i].first, (long long)j->procs[i].last,
+		     j->procs[i].utime, j->procs[i].stime, j->procs[i].rss,
+		     j->procs[i].reaped, j->procs[i].stray);
+	n += rec_escape(rec + n, sizeof(rec) - 1 - n, j->procs[i].cmd);
+	rec[n++] = '\n';
+	if (write(fd, rec, n) != (ssize_t) n)
+	    break;
+    }
+}
+
+static void
+procs_debug(struct syncsh_job *j)
+{
+    int i;
+
+    for (i = 0; i < j->nprocs; i++)
+	fprintf(stderr, "%s: %8.3fs %8.3fs cpu %8ldK%s %s\n", prog,
+		(j->procs[i].last - j->procs[i].first) / 1e6,
+		(j->procs[i].utime + j->procs[i].stime) / 1e6, j->procs[i].rss,
+		j->procs[i].stray ? " stray" : "", j->procs[i].cmd);
+}
+
+#endif
+
+/*
+ * Live events, SYNCSH_EVENTS=<socket>. Each job has a connection of
+ * its own to the broker, a SOCK_SEQPACKET socket so every event stays
+ * one message, and never waits on it: an event with no room in the
+ * send buffer is dropped. Output events may only fill half the buffer
+ * (where SIOCOUTQ says how full it is) so the rest is kept for the
+ * small lifecycle events, and once output has been dropped no more
+ * is sent; the exit event says so.
+ */
+static unsigned evjobs;
+
+static void
+event_open(struct syncsh_job *j)
+{
+    struct sockaddr_un sa;
+    char *path = getenv(PFX "EVENTS");
+    int fd, size = 1 << 20;
+    socklen_t len = sizeof(size);
+
+    if (!path)
+	return;
+    if (!is_absolute(path) || strlen(path) >= sizeof(sa.sun_path)) {
+	fprintf(stderr, "%s: Error: bad socket path '%s'\n", prog, path);
+	return;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+	return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+	if (getenv(PFX "DEBUG"))
+	    fprintf(stderr, "%s: no event broker at %s\n", prog, path);
+	close(fd);
+	return;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == -1)
+	size = 1 << 16;
+    j->evfd = fd;
+    j->evroom = size / 2;
+    j->evjob = __sync_add_and_fetch(&evjobs, 1);
+}
+
+static int
+event_send(struct syncsh_job *j, int type, int stream, const void *p, size_t len)
+{
+    struct syncsh_event ev;
+    struct iovec iov[2];
+
+    if (j->evfd < 0)
+	return -1;
+    if (len > SYNCSH_EV_MAX - sizeof(ev))
+	len = SYNCSH_EV_MAX - sizeof(ev);
+    memset(&ev, 0, sizeof(ev));
+    ev.len = sizeof(ev) + len;
+    ev.type = type;
+    ev.stream = stream;
+    ev.pid = getpid();
+    ev.seq = j->evseq++;
+    ev.job = j->evjob;
+    ev.t = now_us();
+    iov[0].iov_base = &ev;
+    iov[0].iov_len = sizeof(ev);
+    iov[1].iov_base = (void *)p;
+    iov[1].iov_len = len;
+    if (writev(j->evfd, iov, 2) != -1)
+	return 0;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+	/* The broker has gone away. */
+	close(j->evfd);
+	j->evfd = -1;
+    }
+
+    return -1;
+}
+
+/* Send a stream's output in as many events as it takes, room permitting. */
+static void
+event_output(struct syncsh_job *j, int stream, const void *p, size_t len)
+{
+    size_t max = SYNCSH_EV_MAX - sizeof(struct syncsh_event), n;
+    int queued = 0;
+
+    for (; len && !j->evtrunc; len -= n, p = (const char *)p + n) {
+	n = len < max ? len : max;
+#ifdef SIOCOUTQ
+	if (ioctl(j->evfd, SIOCOUTQ, &queued) == -1)
+	    queued = 0;
+#endif
+	if (queued + (int)n > j->evroom
+	    || event_send(j, SYNCSH_EV_OUTPUT, stream, p, n))
+	    j->evtrunc = 1;
+    }
+}
+
+/*
+ * The status line, SYNCSH_STATUS=<ms>. Recipes which succeed without
+ * output show nothing but a status line on the terminal, rewritten in
+ * place, of the recipes finished and started, how many are running
+ * and the one running longest. Those are kept in the shared state,
+ * each running recipe in a slot of its own, and the line is redrawn
+ * as recipes start and end at most every <ms> milliseconds (100 by
+ * default) by whoever gets the output lock without waiting, and after
+ * every block of output. The line ends in a carriage return so that
+ * anything else written to the terminal simply overwrites it. A build
+ * counts afresh after a second with nothing running.
+ */
+static const char status_erase[] = "\r\033[K";
+
+/*
+ * Draw the line, unless 'within' usec of the last one is not yet over
+ * once the lock is held; the time is only stamped once it is drawn.
+ */
+static void
+status_draw(struct syncsh_job *j, int locked, int64_t within)
+{
+    struct status_slot *sl, *oldest = NULL;
+    char line[512], name[STATUS_NAME];
+    int64_t now = now_us(), start = 0;
+    struct winsize ws;
+    struct flock fl;
+    int cols = 80, running = 0, i, n;
+
+    if (!locked) {
+	/* A broker's lock is too far away to try for a status line. */
+	if (getenv(PFX "LOCKD") || pthread_mutex_trylock(&output_mutex))
+	    return;
+	if (!acquire_semaphore(j, &fl, 0, now)) {
+	    pthread_mutex_unlock(&output_mutex);
+	    return;
+	}
+    }
+    if (within && now - shm->status_drawn < within)
+	goto out;
+    for (i = 0; i < STATUS_SLOTS; i++) {
+	sl = &shm->status[i];
+	if (!sl->pid || !pid_alive(sl->pid))
+	    continue;
+	running++;
+	if (!oldest || sl->start < oldest->start)
+	    oldest = sl;
+    }
+    if (oldest) {
+	start = oldest->start;
+	memcpy(name, oldest->name, sizeof(name));
+	name[sizeof(name) - 1] = '\0';
+    }
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col > 1)
+	cols = ws.ws_col;
+    n = snprintf(line, sizeof(line), "%s[%u/%u] %d running", status_erase,
+		 shm->status_finished, shm->status_started, running);
+    if (oldest && n < (int)sizeof(line))
+	n += snprintf(line + n, sizeof(line) - n, ", slowest %.1fs: %s",
+		      (now - start) / 1e6, name);
+    if (n > (int)sizeof(line) - 2)
+	n = sizeof(line) - 2;
+    if (n > (int)sizeof(status_erase) - 1 + cols - 1)
+	n = sizeof(status_erase) - 1 + cols - 1;
+    line[n++] = '\r';
+    write(STDOUT_FILENO, line, n);
+    shm->status_drawn = now;
+out:
+    if (!locked) {
+	release_semaphore(j, &fl);
+	pthread_mutex_unlock(&output_mutex);
+    }
+}
+
+/* Redraw unless it was done too recently, or someone else gets to. */
+static void
+status_update(struct syncsh_job *j, int force)
+{
+    const char *env = getenv(PFX "STATUS");
+    int64_t ms = atoi(env), within = force ? 0 : (ms > 0 ? ms : 100) * 1000;
+
+    if (!within || now_us() - shm->status_drawn >= within)
+	status_draw(j, 0, within);
+}
+
+static void
+status_begin(struct syncsh_job *j)
+{
+    struct status_slot *sl;
+    int64_t now = now_us();
+    int i, slot = -1, running = 0;
+    size_t n;
+
+    if (!getenv(PFX "STATUS") || !isatty(STDOUT_FILENO) || !shm_attach(j->syncfd))
+	return;
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    for (i = 0; i < STATUS_SLOTS; i++) {
+	sl = &shm->status[i];
+	if (sl->pid && pid_alive(sl->pid))
+	    running++;
+	else if (slot == -1)
+	    slot = i;
+    }
+    if (!running && now - shm->status_last > 1000000)
+	shm->status_started = shm->status_finished = 0;
+    if (slot != -1) {
+	sl = &shm->status[slot];
+	sl->pid = getpid();
+	sl->start = now;
+	n = strcspn(j->recipe, "\n");
+	snprintf(sl->name, sizeof(sl->name), "%.*s", (int)n, j->recipe);
+	shm->status_started++;
+	shm->status_last = now;
+	j->status_slot = slot;
+    }
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+    if (j->status_slot >= 0)
+	status_update(j, 0);
+}
+
+static void
+status_end(struct syncsh_job *j)
+{
+    int i, running = 0;
+
+    shm_lock(SHM_LOCK_TABLE, F_WRLCK, 1);
+    shm->status[j->status_slot].pid = 0;
+    shm->status_finished++;
+    shm->status_last = now_us();
+    for (i = 0; i < STATUS_SLOTS; i++)
+	if (shm->status[i].pid && pid_alive(shm->status[i].pid))
+	    running++;
+    shm_lock(SHM_LOCK_TABLE, F_UNLCK, 0);
+    j->status_slot = -1;
+
+    /* The last to finish makes sure the line is up to date. */
+    status_update(j, !running);
+}
+
+/* Let go of anything still held if a job is abandoned part way. */
+static void
+job_release(struct syncsh_job *j)
+{
+    if (j->capsem)
+	release_semaphore(j, j->capsem);
+    if (j->sem)
+	release_semaphore(j, j->sem);
+    j->capsem = j->sem = NULL;
+    if (j->rd)
+	j->stats.budgetpeak = arena_release(j->rd);
+    j->rd = NULL;
+    if (j->out)
+	fclose(j->out);
+    if (j->err)
+	fclose(j->err);
+    j->out = j->err = NULL;
+
+    /* With no result any waiters will run the recipe themselves. */
+    if (j->coalesce_slot >= 0)
+	coalesce_end(j);
+    if (j->status_slot >= 0)
+	status_end(j);
+    if (j->admit_slot >= 0)
+	admit_release(j, 0);
+    if (j->ownsync)
+	close(j->syncfd);
+    j->ownsync = 0;
+}
+
+static void
+job_free(struct syncsh_job *j)
+{
+    if (j->cls)
+	class_free(j->cls);
+    if (j->evfd >= 0)
+	close(j->evfd);
+#ifdef __linux__
+    free(j->procs);
+#endif
+    free(j->recipe);
+    free(j->shell);
+    free(j);
+}
+
+void
+syncsh_progname(const char *name)
+{
+    prog = name;
+}
+
+syncsh_job_t *
+syncsh_begin(const char *recipe, const char *shell, int flags)
+{
+    struct syncsh_job *j;
+    char *syncfile;
+    char *serialize;
+    char *classes;
+    int cap;
+
+    if (!(j = calloc(1, sizeof(*j)))) {
+	syserr(0, "calloc");
+	return NULL;
+    }
+    j->stats.start = now_us();
+    j->stats.serwait = -1;
+    j->stats.capwait = -1;
+    j->stats.held = -1;
+    j->stats.budgetpeak = -1;
+    j->stats.admitwait = -1;
+    j->recipe = strdup(recipe);
+    j->shell = strdup(shell);
+    j->flags = flags;
+    j->syncfd = -1;
+    j->coalesce_slot = -1;
+    j->evfd = -1;
+    j->lockfd = -1;
+    j->status_slot = -1;
+    j->admit_slot = -1;
+#ifdef __linux__
+    j->pin_slot = -1;
+#endif
+
+    if ((syncfile = getenv(PFX "SYNCFILE"))) {
+	if (!is_absolute(syncfile)) {
+	    fprintf(stderr, "%s: Error: '%s' must be an absolute path\n",
+		    prog, syncfile);
+	    goto fail;
+	}
+
+	/*
+	 * Note that we NEVER write to a syncfile but must open
+	 * it for write in order for fcntl() to acquire the lock.
+	 */
+	if ((j->syncfd = open(syncfile, O_WRONLY | O_APPEND)) == -1) {
+	    syserr(0, syncfile);
+	} else {
+	    j->ownsync = 1;
+	    if (getenv(PFX "DEBUG"))
+		fprintf(stderr, "%s: syncing with %d=%s\n", prog, j->syncfd,
+			syncfile);
+	}
+    } else {
+	if (STREAM_OK(stdout)) {
+	    j->syncfd = fileno(stdout);
+	} else if (STREAM_OK(stderr)) {
+	    j->syncfd = fileno(stderr);
+	} else {
+	    syserr(0, "stdout");
+	}
+    }
+
+    if ((classes = getenv(PFX "CLASSES")))
+	j->cls = classify(classes, j->recipe);
+
+    /*
+     * A recipe in a cacheable class may not need to run at all.
+     * On a hit its recorded output is loaded into the tempfiles
+     * and everything from here on proceeds as if it had run.
+     */
+    if (j->cls && j->cls->cache && (j->cachedir = getenv(PFX "CACHE"))
+	&& !cache_init(j->cachedir)
+	&& !cache_key(j->cls, j->shell, j->recipe, j->cachekey)) {
+	if (!(j->out = capture_open()) || !(j->err = capture_open())) {
+	    syserr(0, "tmpfile");
+	    goto fail;
+	}
+	if ((j->hit = cache_replay(j->cachedir, j->cachekey, j->out, j->err,
+				   &j->stats.exitcode)) == -1)
+	    goto fail;
+	j->stats.cache = j->hit ? 2 : 1;
+    }
+
+    /*
+     * We could be asked to serialize a certain type of recipe
+     * in which case the semaphore is acquired *before* the fork
+     * and we don't need to bother about tempfiles.
+     */
+    if (!j->hit && (serialize = getenv(PFX "SERIALIZE"))) {
+	regex_t re;
+
+	if (regcomp(&re, serialize, REG_EXTENDED)) {
+	    /* TODO - generate a better error message */
+	    fprintf(stderr, "%s: Error: bad regular expression '%s'\n", prog,
+		    serialize);
+	} else {
+	    regmatch_t pm[1];
+
+	    if (!regexec(&re, j->recipe, 1, pm, 0)) {
+		uint16_t hash;
+
+		hash = str_hash(serialize, strlen(serialize));
+		j->sem = acquire_semaphore(j, &j->fl, hash, 0);
+		j->stats.serwait = now_us() - j->stats.start;
+	    }
+	    regfree(&re);
+	}
+    }
+
+    /*
+     * An identical recipe may already be running elsewhere in the
+     * build, in which case wait for it and share its result.
+     */
+    if (!j->sem && !j->hit && getenv(PFX "COALESCE") && shm_attach(j->syncfd)) {
+	switch (coalesce_begin(j)) {
+	case COALESCE_REPLAY:
+	    j->hit = 1;
+	    j->stats.coalesced = 2;
+	    break;
+	case COALESCE_OWNER:
+	    j->stats.coalesced = 1;
+	    break;
+	}
+    }
+
+    /* Otherwise, prepare the tempfiles. */
+    if (!j->sem) {
+	if (!j->out && (!(j->out = capture_open()) || !(j->err = capture_open()))) {
+	    syserr(0, "tmpfile");
+	    goto fail;
+	}
+    } else if (j->out) {
+	/* Serialized output goes straight out so can't be cached. */
+	fclose(j->out);
+	fclose(j->err);
+	j->out = j->err = NULL;
+	j->cachekey[0] = '\0';
+    }
+
+    /*
+     * Classes may be capped at so many concurrent recipes. This is
+     * taken after any SERIALIZE lock so the two are always acquired
+     * in the same order.
+     */
+    if (!j->hit && j->cls && (cap = class_cap(j->cls)) > 0) {
+	int64_t t = now_us();
+
+	j->capsem = acquire_counting_semaphore(j, &j->capfl,
+		0x10000 + (off_t) str_hash(j->cls->name, strlen(j->cls->name)) * 256,
+		cap < 256 ? cap : 256);
+	j->stats.capwait = now_us() - t;
+    }
+
+    event_open(j);
+    event_send(j, SYNCSH_EV_START, 0, j->recipe, strlen(j->recipe));
+    status_begin(j);
+
+    return j;
+
+  fail:
+    job_release(j);
+    job_free(j);
+    return NULL;
+}
+
+int
+syncsh_replayed(syncsh_job_t *j)
+{
+    return j->hit;
+}
+
+int
+syncsh_fd(syncsh_job_t *j, int stream)
+{
+    if (stream == 2)
+	return j->err ? fileno(j->err) : fileno(stderr);
+    return j->out ? fileno(j->out) : fileno(stdout);
+}
+
+pid_t
+syncsh_spawn(syncsh_job_t *j, char *const argv[])
+{
+    long long threshold;
+#ifdef __linux__
+    sigset_t sigchld;
+    char *cgroup;
+#endif
+
+    if (j->hit)
+	return 0;
+
+    /* Wait for memory before taking cpus. */
+    admit_acquire(j);
+
+#ifdef __linux__
+    if (getenv(PFX "PIN") && shm_attach(j->syncfd))
+	pin_acquire(j);
+    if ((cgroup = getenv(PFX "CGROUP")))
+	cgroup_create(j, cgroup);
+
+    /*
+     * Become the reaper for the recipe's orphans and take SIGCHLD
+     * synchronously so procs_wait() wakes as soon as anything exits.
+     * Both affect the whole process, so only when it's ours to change.
+     */
+    if ((j->flags & SYNCSH_OWN_PROCESS) && getenv(PFX "PROCS")
+	&& (j->procs = calloc(MAX_PROCS, sizeof(struct proc)))
+	&& prctl(PR_SET_CHILD_SUBREAPER, 1) != -1) {
+	j->procs_on = 1;
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &sigchld, &j->sigmask);
+    }
+#endif
+
+    /*
+     * Started after SIGCHLD is blocked so the reader thread has it
+     * blocked too. Line mode needs the reader, but not compression.
+     */
+    j->lines = j->out && getenv(PFX "LINES");
+    if (j->lines && getenv(PFX "LOCKD")) {
+	/* Lines would go round the broker's lock, and its log. */
+	fprintf(stderr, "%s: Warning: %s is ignored with %s\n", prog,
+		PFX "LINES", PFX "LOCKD");
+	j->lines = 0;
+    }
+    if (j->out && ((threshold = arena_threshold()) >= 0 || j->lines))
+	j->rd = arena_start(j, threshold >= 0 ? threshold : LLONG_MAX);
+    if (j->lines && (!j->rd || !j->rd->linebuf))
+	j->lines = 0;
+
+    /* GNU make uses vfork so we do too */
+    j->child = vfork();
+    if (j->child == (pid_t) 0) {
+#ifdef __linux__
+	if (j->pin_slot >= 0
+	    && sched_setaffinity(0, sizeof(j->pinset), &j->pinset) == -1)
+	    syserr(0, "sched_setaffinity");
+	if (*j->cgdir)
+	    cgroup_write(j, "cgroup.procs", "0");
+	if (j->procs_on)
+	    sigprocmask(SIG_SETMASK, &j->sigmask, NULL);
+#endif
+
+	if (j->out && (close(fileno(stdout)) == -1
+		       || (dup2(j->rd ? j->rd->wfd[0] : fileno(j->out),
+				fileno(stdout)) == -1)))
+	    syserr(2, "dup2(stdout)");
+
+	if (j->err && (close(fileno(stderr)) == -1
+		       || (dup2(j->rd ? j->rd->wfd[1] : fileno(j->err),
+				fileno(stderr)) == -1)))
+	    syserr(2, "dup2(stderr)");
+
+	if (j->cls)
+	    class_apply(j->cls);
+
+	execvp(argv[0], argv);
+	perror(argv[0]);
+	_exit(EXIT_FAILURE);
+    }
+    if (j->rd)
+	arena_detach(j->rd);
+    if (j->child == (pid_t) - 1) {
+	syserr(0, "fork");
+	j->child = 0;
+	if (j->admit_slot >= 0)
+	    admit_release(j, 0);
+	return -1;
+    }
+
+    return j->child;
+}
+
+int
+syncsh_finish(syncsh_job_t *j, int status)
+{
+    struct stat stbuf;
+
+    if (j->hit) {
+	j->status = j->stats.exitcode << 8;
+    } else if (j->child > 0) {
+#ifdef __linux__
+	if (j->procs_on) {
+	    procs_wait(j);
+	    pthread_sigmask(SIG_SETMASK, &j->sigmask, NULL);
+	} else
+#endif
+	while (wait4(j->child, &j->status, 0, &j->stats.ru) == -1
+	       && errno == EINTR)
+	    continue;
+	j->child = 0;
+    } else {
+	j->status = status;
+    }
+    if (!j->hit)
+	j->stats.exitcode = WIFEXITED(j->status) ? WEXITSTATUS(j->status)
+	    : 128 + WTERMSIG(j->status);
+
+    if (j->capsem) {
+	release_semaphore(j, j->capsem);
+	j->capsem = NULL;
+    }
+
+#ifdef __linux__
+    if (j->pin_slot >= 0)
+	pin_release(j);
+    if (*j->cgdir)
+	cgroup_collect(j);
+#endif
+    if (j->admit_slot >= 0)
+	admit_release(j, 1);
+
+    /*
+     * A compressed capture is published from the arena, unless the
+     * result has to be kept for the cache or coalesced waiters, which
+     * read the capture files.
+     */
+    if (j->rd) {
+	arena_stop(j->rd);
+	j->stats.held = j->rd->a[0]->held + j->rd->a[1]->held;
+	j->stats.spills = j->rd->spilled;
+	if ((j->coalesce_slot >= 0 || (*j->cachekey && !j->stats.exitcode))
+	    && !arena_expand(j->rd, j->out, j->err)) {
+	    j->stats.budgetpeak = arena_release(j->rd);
+	    j->rd = NULL;
+	}
+    }
+
+    if (j->out && lseek(fileno(j->out), 0, SEEK_SET) == -1)
+	syserr(0, "lseek(stdout)");
+
+    if (j->err && lseek(fileno(j->err), 0, SEEK_SET) == -1)
+	syserr(0, "lseek(stderr)");
+
+    if (j->out) {
+	if (!fstat(fileno(j->out), &stbuf))
+	    j->stats.outbytes = stbuf.st_size;
+	if (!fstat(fileno(j->err), &stbuf))
+	    j->stats.errbytes = stbuf.st_size;
+    }
+    if (j->rd) {
+	j->stats.outbytes = j->rd->a[0]->raw;
+	j->stats.errbytes = j->rd->a[1]->raw;
+    }
+
+    if (j->coalesce_slot >= 0)
+	coalesce_end(j);
+
+    /* Only successful runs are worth remembering. */
+    if (*j->cachekey && !j->hit && !j->stats.exitcode)
+	cache_store(j);
+
+    return j->stats.exitcode;
+}
+
+/*
+ * Publishing is planned in full before the output lock is taken: the
+ * sinks are opened, the headline formatted and the captured output
+ * mapped (and faulted in) so that the lock covers nothing but one
+ * writev() per sink.
+ */
+struct view {
+    void *p;
+    size_t len;
+    int mapped;			/* p is an mmap() rather than malloc() */
+};
+
+enum { SINK_OUT, SINK_ERR, SINK_TEE, SINKS };
+
+struct plan {
+    char *headline;
+    struct view out, err;
+    int fd[SINKS];
+    int nbfd[SINKS];		/* non-blocking reopen of fd[], or -1 */
+    struct iovec iov[SINKS][3];
+    struct iovec *next[SINKS];	/* what's still to be written */
+    int niov[SINKS];
+    int64_t deadline;		/* for writes, usec, or 0 */
+    struct arena_reader *rd;	/* compressed capture, streamed after the iovecs */
+    unsigned char *scratch;
+    struct arena_cursor stall[2];	/* where stdout and stderr stopped */
+    int quiet;			/* stdout and stderr get no arena chunks */
+    char *summary;		/* written instead of the output, or NULL */
+    char *shown[2];		/* SYNCSH_DIAGS: what stdout and stderr get */
+    size_t nshown[2];
+};
+
+/* Make a capture file's contents addressable, reading ahead if need be. */
+static int
+view_open(struct view *v, FILE *fp)
+{
+    struct stat st;
+    int flags = MAP_PRIVATE;
+    ssize_t n;
+    size_t got;
+
+    memset(v, 0, sizeof(*v));
+    if (!fp)
+	return 0;
+    if (fstat(fileno(fp), &st) == -1)
+	return -1;
+    if (!st.st_size)
+	return 0;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    v->len = st.st_size;
+    v->p = mmap(NULL, v->len, PROT_READ, flags, fileno(fp), 0);
+    if (v->p != MAP_FAILED) {
+	v->mapped = 1;
+	return 0;
+    }
+
+    /* Not mappable, so read it in instead. */
+    if (!(v->p = malloc(v->len)))
+	return -1;
+    for (got = 0; got < v->len; got += n) {
+	EINTR_CHECK(n, pread(fileno(fp), (char *)v->p + got, v->len - got, got));
+	if (n <= 0) {
+	    v->len = got;
+	    return n < 0 ? -1 : 0;
+	}
+    }
+
+    return 0;
+}
+
+static void
+view_close(struct view *v)
+{
+    if (v->mapped)
+	munmap(v->p, v->len);
+    else
+	free(v->p);
+}
+
+static void
+plan_add(struct plan *pl, int sink, void *p, size_t len)
+{
+    if (pl->fd[sink] < 0 || !len)
+	return;
+    pl->iov[sink][pl->niov[sink]].iov_base = p;
+    pl->iov[sink][pl->niov[sink]].iov_len = len;
+    pl->next[sink] = pl->iov[sink];
+    pl->niov[sink]++;
+}
+
+/* Step over 'done' bytes of an iovec array. */
+static struct iovec *
+iov_advance(struct iovec *iov, int *n, size_t done)
+{
+    for (; *n > 0 && done >= iov->iov_len; iov++, (*n)--)
+	done -= iov->iov_len;
+    if (*n > 0) {
+	iov->iov_base = (char *)iov->iov_base + done;
+	iov->iov_len -= done;
+    }
+
+    return iov;
+}
+
+/*
+ * Write all of an iovec array, coping with partial writes. A sink
+ * opened non-blocking is waited on with poll() until 'deadline', then
+ * given up on with errno ETIMEDOUT and '*iov' left at what's unwritten.
+ */
+static int
+writev_by(int fd, struct iovec **iov, int *n, int64_t deadline)
+{
+    struct pollfd pfd;
+    int64_t left;
+    ssize_t nw;
+
+    while (*n > 0) {
+	if ((nw = writev(fd, *iov, *n)) > 0) {
+	    *iov = iov_advance(*iov, n, nw);
+	    continue;
+	}
+	if (nw == -1 && errno == EINTR)
+	    continue;
+	if (nw == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	    return -1;
+	if ((left = deadline - now_us()) <= 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	poll(&pfd, 1, (int)((left + 999) / 1000));
+    }
+
+    return 0;
+}
+
+/*
+ * A non-blocking descriptor for a sink which may stall, i.e. anything
+ * but a regular file. It's opened afresh through /proc so O_NONBLOCK
+ * doesn't leak into the file description shared with make and every
+ * other writer.
+ */
+static int
+sink_nonblock(int fd)
+{
+#ifdef __linux__
+    char path[64];
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) == -1 || S_ISREG(st.st_mode))
+	return -1;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    return open(path, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+#else
+    return -1;
+#endif
+}
+
+/* A duration in seconds (fractions allowed) from the environment, in usec. */
+static int64_t
+env_usec(const char *name)
+{
+    char *val = getenv(name);
+    double secs = val ? atof(val) : 0;
+
+    return secs > 0 ? (int64_t) (secs * 1e6) : 0;
+}
+
+/*
+ * The overflow spool. Output which can't be published in time - the
+ * output lock wasn't had within SYNCSH_LOCKWAIT, or the terminal took
+ * none of it for SYNCSH_WRITEWAIT - is appended here so the build
+ * doesn't freeze behind a stopped terminal. SYNCSH_SPOOL names it;
+ * by default it sits in $TMPDIR beside the shared state.
+ */
+static void
+spool_write(struct syncsh_job *j, struct plan *pl, const char *why)
+{
+    char path[PATH_MAX], note[256];
+    struct iovec iov[1 + 2 * 3], *next = iov;
+    char *spool = getenv(PFX "SPOOL");
+    int fd, n = 1, i, k;
+
+    if (spool && !is_absolute(spool)) {
+	fprintf(stderr, "%s: Error: '%s' not an absolute path\n", prog, spool);
+	return;
+    }
+    if (spool)
+	snprintf(path, sizeof(path), "%s", spool);
+    else if (sync_path(j->syncfd, "spool", path, sizeof(path)) == -1)
+	return;
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+	syserr(0, path);
+	return;
+    }
+
+    iov[0].iov_base = note;
+    iov[0].iov_len = snprintf(note, sizeof(note),
+			      "%s: %s, output of '%.160s' follows\n",
+			      prog, why, j->recipe);
+    if (iov[0].iov_len >= sizeof(note))
+	iov[0].iov_len = sizeof(note) - 1;
+    for (i = SINK_OUT; i <= SINK_ERR; i++) {
+	for (k = 0; k < pl->niov[i]; k++)
+	    iov[n++] = pl->next[i][k];
+	pl->niov[i] = 0;
+    }
+    flock(fd, LOCK_EX);
+    if (writev_by(fd, &next, &n, 0))
+	syserr(0, path);
+    for (i = 0; pl->rd && i < 2; i++)
+	if (pl->stall[i].c && arena_write(&pl->stall[i], fd, pl->scratch))
+	    syserr(0, path);
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (getenv(PFX "DEBUG"))
+	fprintf(stderr, "%s: %s, output of '%s' spooled to %s\n", prog, why,
+		j->recipe, path);
+}
+
+/*
+ * The sharded tee. SYNCSH_TEESHARDS=<n>[:pid|class|dir] splits the tee
+ * over <tee>.0 ... <tee>.<n-1>, chosen by the syncsh pid (the default),
+ * the recipe's class or the directory it ran in. Entries are appended
+ * after the output lock has gone, each under a lock on its shard
+ * alone, so the tee no longer adds to the time the lock is held. An
+ * entry is a header line
+ *
+ *     @@syncsh<TAB>seq=<n><TAB>t=<usec><TAB>pid=<pid><TAB>len=<bytes><TAB>r=<recipe>
+ *
+ * and then the output. The sequence number comes from a counter in
+ * the shared state and is taken under the shard lock, so each shard
+ * is in order and "syncsh log merge" can interleave them again.
+ */
+static int
+tee_shard(struct syncsh_job *j)
+{
+    char *spec = getenv(PFX "TEESHARDS"), *by, cwd[PATH_MAX];
+    const char *key = NULL;
+    int n;
+
+    if (!spec || (n = atoi(spec)) <= 0)
+	return -1;
+    if ((by = strchr(spec, ':')) && !strcmp(by + 1, "class"))
+	key = j->cls ? j->cls->name : "";
+    else if (by && !strcmp(by + 1, "dir"))
+	key = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    else if (by && strcmp(by + 1, "pid"))
+	fprintf(stderr, "%s: Error: bad %s '%s'\n", prog, PFX "TEESHARDS", spec);
+
+    return key ? (int)(str_hash64(key, strlen(key)) % n) : getpid() % n;
+}
+
+/*
+ * A log entry's worth of the plan, as it goes to the tee: up to three
+ * iovecs, followed by any arena chunks. Sets '*len' to the total.
+ */
+static int
+plan_log_iov(struct plan *pl, struct iovec *iov, size_t *len)
+{
+    struct chunk *c;
+    int n = 0, i;
+
+    if (pl->headline) {
+	iov[n].iov_base = pl->headline;
+	iov[n++].iov_len = strlen(pl->headline);
+    }
+    if (pl->out.len) {
+	iov[n].iov_base = pl->out.p;
+	iov[n++].iov_len = pl->out.len;
+    }
+    if (pl->err.len) {
+	iov[n].iov_base = pl->err.p;
+	iov[n++].iov_len = pl->err.len;
+    }
+    for (*len = 0, i = 0; i < n; i++)
+	*len += iov[i].iov_len;
+    for (i = 0; pl->rd && i < 2; i++)
+	for (c = pl->rd->a[i]->head; c; c = c->next)
+	    *len += c->len;
+
+    return n;
+}
+
+/*
+ * The next tee entry's sequence number, taken while the output lock
+ * is held so that merging the shards gives the order of the output.
+ */
+static unsigned long long
+tee_shard_seq(struct syncsh_job *j)
+{
+    if (shm_attach(j->syncfd))
+	return __atomic_add_fetch(&shm->tee_seq, 1, __ATOMIC_RELAXED);
+
+    return now_us();
+}
+
+static void
+tee_shard_write(struct syncsh_job *j, struct plan *pl, const char *tee, int shard,
+		unsigned long long seq)
+{
+    char path[PATH_MAX], head[PIPE_BUF];
+    struct iovec iov[4], *next = iov;
+    struct arena_cursor cur;
+    size_t len, hl;
+    int fd, n = 1, i;
+
+    snprintf(path, sizeof(path), "%s.%d", tee, shard);
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+	syserr(0, path);
+	return;
+    }
+    n += plan_log_iov(pl, iov + 1, &len);
+
+    flock(fd, LOCK_EX);
+    hl = snprintf(head, sizeof(head), "@@syncsh\tseq=%llu\tt=%lld\tpid=%ld\tlen=%llu\tr=",
+		  seq, (long long)now_us(), (long)getpid(), (unsigned long long)len);
+    hl += rec_escape(head + hl, sizeof(head) - hl - 1, j->recipe);
+    head[hl++] = '\n';
+    iov[0].iov_base = head;
+    iov[0].iov_len = hl;
+    if (writev_by(fd, &next, &n, 0))
+	syserr(0, path);
+    for (i = 0; pl->rd && i < 2; i++) {
+	cur.c = pl->rd->a[i]->head;
+	cur.off = 0;
+	if (arena_write(&cur, fd, pl->scratch))
+	    syserr(0, path);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/*
+ * The output lock from a "syncsh lockd" broker, SYNCSH_LOCKD=<socket>
+ * or <host>:<port>, for builds on machines which share no filesystem
+ * fcntl() locks can be trusted on. The request carries the job's log
+ * entry, so the upload overlaps the wait and the broker appends it to
+ * its log as it grants the lock; closing the connection releases it.
+ */
+static int
+lockd_connect(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sa;
+    char host[256], *port;
+    int fd = -1, one = 1;
+
+    if (is_absolute(addr)) {
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(addr) >= sizeof(sa.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	    return -1;
+	strcpy(sa.sun_path, addr);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+	    close(fd);
+	    return -1;
+	}
+    } else {
+	snprintf(host, sizeof(host), "%s", addr);
+	if (!(port = strrchr(host, ':'))) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(*host ? host : NULL, port, &hints, &res)) {
+	    errno = EHOSTUNREACH;
+	    return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+	    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+		continue;
+	    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != -1)
+		break;
+	    close(fd);
+	    fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+	    return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/*
+ * Like acquire_semaphore() but from the broker. If it can't be
+ * reached the local lock is used instead, so the build carries on.
+ */
+static struct flock *
+lockd_acquire(struct syncsh_job *j, struct plan *pl, const char *addr,
+	      int64_t deadline)
+{
+    struct iovec iov[4], *next = iov;
+    struct arena_cursor cur;
+    struct timespec zero = { 0, 0 };
+    struct pollfd pfd;
+    sigset_t pipeset, oldset;
+    char head[64], grant;
+    size_t len;
+    int fd, n = 1, i, ms, rc = 0;
+
+    if ((fd = lockd_connect(addr)) == -1) {
+	fprintf(stderr, "%s: Error: can't reach lock broker %s: %s\n", prog,
+		addr, strerror(errno));
+	return acquire_semaphore(j, &j->fl, 0, deadline);
+    }
+    n += plan_log_iov(pl, iov + 1, &len);
+    iov[0].iov_base = head;
+    iov[0].iov_len = snprintf(head, sizeof(head), "L %zu\n", len);
+
+    /* A broker going away mustn't kill us with SIGPIPE. */
+    sigemptyset(&pipeset);
+    sigaddset(&pipeset, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeset, &oldset);
+    rc = writev_by(fd, &next, &n, 0);
+    for (i = 0; !rc && pl->rd && i < 2; i++) {
+	cur.c = pl->rd->a[i]->head;
+	cur.off = 0;
+	rc = arena_write(&cur, fd, pl->scratch);
+    }
+    if (rc && errno == EPIPE && !sigismember(&oldset, SIGPIPE))
+	sigtimedwait(&pipeset, NULL, &zero);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (rc)
+	goto lost;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+	ms = -1;
+	if (deadline && (ms = (deadline - now_us() + 999) / 1000) <= 0) {
+	    close(fd);
+	    errno = ETIMEDOUT;
+	    return NULL;
+	}
+    } while ((n = poll(&pfd, 1, ms)) == 0 || (n == -1 && errno == EINTR));
+    if (read(fd, &grant, 1) != 1 || grant != 'G')
+	goto lost;
+    if (getenv(PFX "DEBUG"))
+	fprintf(stderr, "%s: locked %s for '%s'\n", prog, addr, j->recipe);
+    j->lockfd = fd;
+    return &j->fl;
+
+  lost:
+    fprintf(stderr, "%s: Error: lost lock broker %s\n", prog, addr);
+    close(fd);
+    return acquire_semaphore(j, &j->fl, 0, deadline);
+}
+
+/* The events for a publish: the lock timings, then the output. */
+static void
+event_publish(struct syncsh_job *j, struct plan *pl)
+{
+    struct syncsh_ev_lock lk;
+    struct chunk *c;
+    int i;
+
+    lk.wait = j->stats.lockwait;
+    lk.hold = j->stats.lockhold;
+    event_send(j, SYNCSH_EV_LOCK, 0, &lk, sizeof(lk));
+    event_output(j, 1, pl->out.p, pl->out.len);
+    event_output(j, 2, pl->err.p, pl->err.len);
+    for (i = 0; pl->rd && i < 2; i++)
+	for (c = pl->rd->a[i]->head; c && !j->evtrunc; c = c->next)
+	    event_output(j, i + 1, chunk_bytes(c, pl->scratch), c->len);
+}
+
+/*
+ * Replay engines, chosen with SYNCSH_REPLAY. "writev" (the default)
+ * writes each sink's iovecs with one writev(). "uring" hands them
+ * all to the kernel in one io_uring submission where that's
+ * available, and otherwise falls back to writev. "pump" is the
+ * original read/write loop over the capture files, kept as a
+ * baseline for comparison.
+ */
+enum { REPLAY_WRITEV, REPLAY_URING, REPLAY_PUMP };
+
+static int
+replay_engine(void)
+{
+    char *e = getenv(PFX "REPLAY");
+
+    if (e && !strcmp(e, "uring"))
+	return REPLAY_URING;
+    if (e && !strcmp(e, "pump"))
+	return REPLAY_PUMP;
+
+    return REPLAY_WRITEV;
+}
+
+/*
+ * Anything left unwritten in a sink which timed out is spooled later,
+ * once the lock has gone. After other failures it's dropped.
+ */
+static void
+replay_writev(struct plan *pl)
+{
+    int i, fd;
+
+    for (i = 0; i < SINKS; i++) {
+	fd = pl->nbfd[i] != -1 ? pl->nbfd[i] : pl->fd[i];
+	if (pl->niov[i]
+	    && writev_by(fd, &pl->next[i], &pl->niov[i], pl->deadline)
+	    && errno != ETIMEDOUT) {
+	    syserr(0, "writev");
+	    pl->niov[i] = 0;
+	}
+    }
+}
+
+/*
+ * Stream a compressed capture after the iovecs, a chunk at a time,
+ * to stdout or stderr and then the tee. A sink that stalls (or never
+ * got the lock, when 'sinks' is 0) is left with a cursor for the
+ * spool; the tee is a file and always gets everything.
+ */
+static void
+replay_arena(struct plan *pl, int sinks)
+{
+    struct iovec iov, *next;
+    const unsigned char *p;
+    struct chunk *c;
+    int i, n, fd, dead;
+
+    for (i = SINK_OUT; i <= SINK_ERR; i++) {
+	fd = pl->nbfd[i] != -1 ? pl->nbfd[i] : pl->fd[i];
+	for (dead = 0, c = pl->rd->a[i]->head; c; c = c->next) {
+	    p = chunk_bytes(c, pl->scratch);
+	    if (dead || pl->stall[i].c || pl->quiet) {
+		/* Nothing more for this sink. */
+	    } else if (!sinks || pl->niov[i]) {
+		pl->stall[i].c = c;	/* it's already behind */
+		pl->stall[i].off = 0;
+	    } else {
+		iov.iov_base = (void *)p;
+		iov.iov_len = c->len;
+		next = &iov;
+		n = 1;
+		if (writev_by(fd, &next, &n, pl->deadline)) {
+		    if (errno == ETIMEDOUT) {
+			pl->stall[i].c = c;
+			pl->stall[i].off = c->len - next->iov_len;
+		    } else {
+			syserr(0, "writev");
+			dead = 1;
+		    }
+		}
+	    }
+	    if (pl->fd[SINK_TEE] >= 0) {
+		iov.iov_base = (void *)p;
+		iov.iov_len = c->len;
+		next = &iov;
+		n = 1;
+		writev_by(pl->fd[SINK_TEE], &next, &n, 0);
+	    }
+	}
+    }
+}
+
+static void
+replay_pump(struct syncsh_job *j, struct plan *pl)
+{
+    int i;
+
+    for (i = 0; pl->headline && i < SINKS; i += SINK_TEE)
+	if (pl->fd[i] >= 0)
+	    write(pl->fd[i], pl->headline, strlen(pl->headline));
+    if (j->out) {
+	pump_from_tmp_fd(fileno(j->out), pl->fd[SINK_OUT]);
+	if (pl->fd[SINK_TEE] >= 0)
+	    pump_from_tmp_fd(fileno(j->out), pl->fd[SINK_TEE]);
+    }
+    if (j->err && j->err != j->out) {
+	pump_from_tmp_fd(fileno(j->err), pl->fd[SINK_ERR]);
+	if (pl->fd[SINK_TEE] >= 0)
+	    pump_from_tmp_fd(fileno(j->err), pl->fd[SINK_TEE]);
+    }
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * The io_uring engine. The ring is set up along with the rest of the
+ * plan, outside the lock. Under it a single io_uring_enter() submits
+ * a writev for every sink, linked so they complete in order (stdout
+ * and stderr are often the same terminal), and waits for them all.
+ * A short write breaks the chain, and a failed submission leaves the
+ * rest unsent; whatever is left is then finished off with writev().
+ */
+struct uring {
+    int fd;
+    void *sq, *cq;
+    size_t sqsize, cqsize, sqesize;
+    struct io_uring_sqe *sqes;
+    unsigned *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+};
+
+static void
+uring_close(struct uring *u)
+{
+    if (u->sqes)
+	munmap(u->sqes, u->sqesize);
+    if (u->cq && u->cq != u->sq)
+	munmap(u->cq, u->cqsize);
+    if (u->sq)
+	munmap(u->sq, u->sqsize);
+    if (u->fd != -1)
+	close(u->fd);
+    u->fd = -1;
+}
+
+static void *
+uring_map(struct uring *u, size_t size, off_t off)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, off);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+uring_open(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = syscall(SYS_io_uring_setup, entries, &p)) == -1)
+	return -1;
+    u->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cqsize > u->sqsize)
+	u->sqsize = u->cqsize;
+    u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (!(u->sq = uring_map(u, u->sqsize, IORING_OFF_SQ_RING))
+	|| !(u->cq = p.features & IORING_FEAT_SINGLE_MMAP ? u->sq
+	     : uring_map(u, u->cqsize, IORING_OFF_CQ_RING))
+	|| !(u->sqes = uring_map(u, u->sqesize, IORING_OFF_SQES))) {
+	uring_close(u);
+	return -1;
+    }
+
+    sq = u->sq;
+    cq = u->cq;
+    u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->cqhead = (unsigned *)(cq + p.cq_off.head);
+    u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void
+replay_uring(struct uring *u, struct plan *pl)
+{
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe;
+    unsigned tail = *u->sqtail, head, idx, n = 0, sent = 0, seen = 0;
+    ssize_t done[SINKS] = { 0 };
+    int sink[SINKS], reaped[SINKS] = { 0 };
+    int i, rc, tries = 0;
+
+    for (i = 0; i < SINKS; i++) {
+	if (!pl->niov[i])
+	    continue;
+	idx = tail++ & *u->sqmask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = pl->fd[i];
+	sqe->addr = (uintptr_t) pl->iov[i];
+	sqe->len = pl->niov[i];
+	sqe->off = (uint64_t) - 1;	/* at the current file position */
+	sqe->user_data = i;
+	u->sqarray[idx] = idx;
+	sink[n++] = i;
+    }
+    if (!n)
+	return;
+    sqe->flags = 0;
+    __atomic_store_n(u->sqtail, tail, __ATOMIC_RELEASE);
+
+    /*
+     * Submit them all and wait for every completion. Nothing may be
+     * rewritten while a submitted write could still be in flight, so
+     * an error only stops submission; what was submitted is reaped.
+     */
+    while (seen < sent || (sent < n && !tries)) {
+	rc = syscall(SYS_io_uring_enter, u->fd, tries ? 0 : n - sent, 1,
+		     IORING_ENTER_GETEVENTS, NULL, 0);
+	if (rc == -1 && errno == EINTR)
+	    continue;		/* resubmitting whatever wasn't taken */
+	if (!tries && rc > 0)
+	    sent += rc;
+	else if (!tries)
+	    tries = 1;		/* submit no more */
+	else if (rc == -1 && ++tries > 100)
+	    break;
+	else if (rc == -1)
+	    usleep(1000);
+	if (tries && !sent)
+	    break;
+	head = *u->cqhead;
+	while (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+	    cqe = &u->cqes[head++ & *u->cqmask];
+	    if (cqe->user_data < SINKS) {
+		if (cqe->res > 0)
+		    done[cqe->user_data] = cqe->res;
+		reaped[cqe->user_data] = 1;
+	    }
+	    seen++;
+	}
+	__atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    /* A sink whose write never came back is given up on. */
+    for (idx = 0; idx < sent; idx++)
+	if (!reaped[sink[idx]]) {
+	    syserr(0, "io_uring_enter");
+	    pl->niov[sink[idx]] = 0;
+	}
+    for (i = 0; i < SINKS; i++)
+	pl->next[i] = iov_advance(pl->iov[i], &pl->niov[i], done[i]);
+    replay_writev(pl);
+}
+#endif
+
+/*
+ * New diagnostics only, SYNCSH_DIAGS=<set>. Each "<file>:<line>[:<col>]:
+ * warning: <message>" line is fingerprinted (the column is left out)
+ * and looked up in <set>, the fingerprints saved from the last good
+ * build, and added to <set>.new, this build's, which "syncsh diags
+ * save" (or jmake, when make succeeds) puts in its place. Only
+ * warnings in neither reach the terminal, along with everything that
+ * isn't a warning and a count of the warnings left out; the lines of
+ * context after a warning (notes, source and carets) go with it. The
+ * tee gets everything. Both sets are open-addressed tables of 64-bit
+ * fingerprints in mmap()ed files: <set> is never written once saved
+ * and <set>.new is only ever added to with compare-and-swap, so no
+ * lookup takes a lock.
+ */
+#define DIAG_MAGIC	0x53594e44
+#define DIAG_MIN_SLOTS	65536
+
+struct diag_set {
+    uint32_t magic;
+    uint32_t full;		/* fingerprints were dropped */
+    uint64_t slots;		/* a power of two */
+    uint64_t count;
+    uint64_t fp[];
+};
+
+static struct diag_set *
+diag_map(const char *path, int create, uint64_t want, size_t *size)
+{
+    struct diag_set *set;
+    struct stat st;
+    uint64_t slots = DIAG_MIN_SLOTS;
+    int fd;
+
+    if ((fd = open(path, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC,
+		   0644)) == -1)
+	return NULL;
+    if (create) {
+	while (slots < 4 * want)
+	    slots *= 2;
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) != -1 && !st.st_size
+	    && ftruncate(fd, sizeof(*set) + slots * sizeof(uint64_t)) == -1)
+	    syserr(0, path);
+	flock(fd, LOCK_UN);
+    }
+    set = NULL;
+    if (fstat(fd, &st) != -1 && st.st_size >= (off_t) sizeof(*set)
+	&& (set = mmap(NULL, st.st_size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+		       MAP_SHARED, fd, 0)) == MAP_FAILED)
+	set = NULL;
+    close(fd);
+    if (!set)
+	return NULL;
+    *size = st.st_size;
+    if (create && !set->magic) {
+	/* Whoever gets here first fills in the header. */
+	if (__sync_bool_compare_and_swap(&set->slots, 0, slots))
+	    set->magic = DIAG_MAGIC;
+	while (!*(volatile uint32_t *)&set->magic)
+	    sched_yield();
+    }
+    if (set->magic != DIAG_MAGIC
+	|| sizeof(*set) + set->slots * sizeof(uint64_t) > *size
+	|| (set->slots & (set->slots - 1))) {
+	fprintf(stderr, "%s: Error: '%s' is not a fingerprint set\n", prog, path);
+	munmap(set, *size);
+	return NULL;
+    }
+
+    return set;
+}
+
+static int
+diag_seen(const struct diag_set *set, uint64_t fp)
+{
+    uint64_t i, v;
+
+    for (i = fp & (set->slots - 1); (v = set->fp[i]); i = (i + 1) & (set->slots - 1))
+	if (v == fp)
+	    return 1;
+
+    return 0;
+}
+
+/* Add a fingerprint: 1 if it's new to the set, 0 if not, -1 if full. */
+static int
+diag_add(struct diag_set *set, uint64_t fp)
+{
+    uint64_t i, v;
+
+    if (set->count >= set->slots / 4 * 3) {
+	set->full = 1;
+	return -1;
+    }
+    for (i = fp & (set->slots - 1);; i = (i + 1) & (set->slots - 1)) {
+	if (!(v = set->fp[i]) && (v = __sync_val_compare_and_swap(&set->fp[i], 0, fp)) == 0) {
+	    __sync_add_and_fetch(&set->count, 1);
+	    return 1;
+	}
+	if (v == fp)
+	    return 0;
+    }
+}
+
+/*
+ * The fingerprint of a warning line, or 0 for anything else. Notes
+ * are fingerprinted along with the warning they belong to. A file
+ * name not starting with '/' also takes 'dir', the hash of the cwd.
+ */
+static uint64_t
+diag_fingerprint(const char *p, size_t len, uint64_t dir)
+{
+    const char *end = p + len, *file = p, *q, *msg;
+    uint64_t fp;
+
+    if (len >= 2 && p[0] == '.' && p[1] == '/')
+	file = p += 2;
+    for (; p < end && *p != ':'; p++)
+	if (*p == ' ' || *p == '\t')
+	    return 0;
+    if (p == file || p + 1 >= end || !isdigit((unsigned char)p[1]))
+	return 0;
+    for (q = p + 1; q < end && isdigit((unsigned char)*q); q++)
+	;
+    if (q >= end || *q != ':')
+	return 0;
+    msg = q + 1;
+    if (msg < end && isdigit((unsigned char)*msg)) {
+	for (; msg < end && isdigit((unsigned char)*msg); msg++)
+	    ;
+	if (msg >= end || *msg++ != ':')
+	    return 0;
+    }
+    while (msg < end && *msg == ' ')
+	msg++;
+    if (end - msg < 8 || strncmp(msg, "warning:", 8))
+	return 0;
+    while (end > msg && isspace((unsigned char)end[-1]))
+	end--;
+
+    /* <file>:<line>: and the message, leaving out any column. */
+    fp = str_hash64(file, q + 1 - file);
+    if (*file != '/')
+	fp ^= dir * 0xc2b2ae3d27d4eb4fULL;
+    fp ^= str_hash64(msg, end - msg) * 0x9e3779b97f4a7c15ULL;
+
+    return fp ? fp : 1;
+}
+
+/* Source, carets or a note: context for the diagnostic before. */
+static int
+diag_context(const char *p, size_t len)
+{
+    if (len && (*p == ' ' || *p == '\t'))
+	return 1;
+    return memchr(p, ':', len) && memmem(p, len, ": note:", 7);
+}
+
+/* "In file included from", "<file>: In function ...:": context for the next. */
+static int
+diag_preamble(const char *p, size_t len)
+{
+    while (len && isspace((unsigned char)p[len - 1]))
+	len--;
+    if (len >= 21 && !strncmp(p, "In file included from", 21))
+	return 1;
+    return len && p[len - 1] == ':' && (memmem(p, len, ": In ", 5)
+					|| memmem(p, len, ": At top level:", 15));
+}
+
+/*
+ * Filter one stream: every line, except warnings seen before and
+ * their context, is appended to 'shown'. Lines are judged with any
+ * colours taken out, so coloured and plain warnings are the same.
+ * Returns the number of warnings left out.
+ */
+static long
+diag_filter(const struct diag_set *old, struct diag_set *cur, uint64_t dir,
+	    const char *p, size_t len, char *shown, size_t *nshown)
+{
+    const char *end = p + len, *pre = NULL, *q;
+    struct syncsh_line line[64];
+    char *plain = NULL;
+    size_t n, qn, npre = 0, nlines = 0, at = 0;
+    unsigned flags;
+    uint64_t fp;
+    long known = 0;
+    int hide = 0;
+
+    for (; p < end; p += n) {
+	if (at == nlines) {
+	    nlines = syncsh_scan_lines(p, end - p, line, 64);
+	    at = 0;
+	}
+	n = line[at].len;
+	flags = line[at++].flags;
+	q = p;
+	qn = n;
+	if ((flags & SYNCSH_SCAN_ESC) && (plain || (plain = malloc(len)))) {
+	    qn = scan_strip(p, n, plain);
+	    q = plain;
+	}
+	if (diag_preamble(q, qn) || (pre && qn && (*q == ' ' || *q == '\t'))) {
+	    if (!pre)
+		pre = p;
+	    npre += n;
+	    continue;
+	}
+	if ((fp = diag_fingerprint(q, qn, dir))) {
+	    hide = (old && diag_seen(old, fp)) | (cur && diag_add(cur, fp) == 0);
+	    known += hide;
+	} else if (!diag_context(q, qn)) {
+	    hide = 0;
+	}
+	if (pre && !hide) {
+	    memcpy(shown + *nshown, pre, npre);
+	    *nshown += npre;
+	}
+	pre = NULL;
+	npre = 0;
+	if (!hide) {
+	    memcpy(shown + *nshown, p, n);
+	    *nshown += n;
+	}
+    }
+    if (pre) {
+	memcpy(shown + *nshown, pre, npre);
+	*nshown += npre;
+    }
+    free(plain);
+
+    return known;
+}
+
+/*
+ * Put together what stdout and stderr should get. A compressed
+ * capture is expanded for it, and kept off them in favour of this.
+ * Returns -1 if the output is to go out unfiltered after all.
+ */
+static int
+diag_plan(struct plan *pl, const char *path)
+{
+    char newpath[PATH_MAX], cwd[PATH_MAX], *buf[2] = { NULL, NULL };
+    struct diag_set *old, *cur;
+    struct view *v[2] = { &pl->out, &pl->err };
+    size_t oldsize = 0, cursize = 0, len[2], k;
+    const unsigned char *p;
+    struct chunk *c;
+    uint64_t dir = 0;
+    long known = 0;
+    int i;
+
+    if (!is_absolute(path) || snprintf(newpath, sizeof(newpath), "%s.new", path)
+	>= (int)sizeof(newpath)) {
+	fprintf(stderr, "%s: Error: bad %s '%s'\n", prog, PFX "DIAGS", path);
+	return -1;
+    }
+    old = diag_map(path, 0, 0, &oldsize);
+    if (!(cur = diag_map(newpath, 1, old ? old->count : 0, &cursize)))
+	syserr(0, newpath);
+
+    for (i = 0; i < 2; i++) {
+	len[i] = v[i]->len;
+	for (c = pl->rd ? pl->rd->a[i]->head : NULL; c; c = c->next)
+	    len[i] += c->len;
+	if (!len[i])
+	    continue;
+	if ((pl->rd && !(buf[i] = malloc(len[i])))
+	    || !(pl->shown[i] = malloc(len[i] + 64))) {
+	    /* Better all of it than only what fits. */
+	    syserr(0, "malloc");
+	    for (i = 0; i < 2; i++) {
+		free(buf[i]);
+		free(pl->shown[i]);
+		pl->shown[i] = NULL;
+		pl->nshown[i] = 0;
+	    }
+	    if (old)
+		munmap(old, oldsize);
+	    if (cur)
+		munmap(cur, cursize);
+	    return -1;
+	}
+	if (pl->rd) {
+	    memcpy(buf[i], v[i]->p, v[i]->len);
+	    for (k = v[i]->len, c = pl->rd->a[i]->head; c; k += c->len, c = c->next) {
+		p = chunk_bytes(c, pl->scratch);
+		memcpy(buf[i] + k, p, c->len);
+	    }
+	}
+    }
+    if (getcwd(cwd, sizeof(cwd)))
+	dir = str_hash64(cwd, strlen(cwd));
+    for (i = 0; i < 2; i++)
+	if (pl->shown[i])
+	    known += diag_filter(old, cur, dir, buf[i] ? buf[i] : v[i]->p,
+				 len[i], pl->shown[i], &pl->nshown[i]);
+    if (known && pl->shown[1])
+	pl->nshown[1] += snprintf(pl->shown[1] + pl->nshown[1], 64,
+				  "%s: %ld known warning%s not shown\n", prog, known,
+				  known == 1 ? "" : "s");
+    else if (known && (pl->shown[1] = malloc(64)))
+	pl->nshown[1] = snprintf(pl->shown[1], 64, "%s: %ld known warning%s not shown\n",
+				 prog, known, known == 1 ? "" : "s");
+    if (pl->rd)
+	pl->quiet = 1;
+    free(buf[0]);
+    free(buf[1]);
+    if (old)
+	munmap(old, oldsize);
+    if (cur)
+	munmap(cur, cursize);
+    return 0;
+}
+
+int
+syncsh_diags_save(const char *path)
+{
+    char newpath[PATH_MAX];
+    struct diag_set *set;
+    size_t size;
+    long long count;
+
+    snprintf(newpath, sizeof(newpath), "%s.new", path);
+    if (!(set = diag_map(newpath, 0, 0, &size)))
+	return -1;
+    count = set->count;
+    if (set->full)
+	fprintf(stderr, "%s: Warning: '%s' filled up, some warnings will show as new\n",
+		prog, newpath);
+    munmap(set, size);
+    if (rename(newpath, path) == -1)
+	return -1;
+
+    return count > INT_MAX ? INT_MAX : (int)count;
+}
+
+/*
+ * Slow terminals, SYNCSH_SLOWSINK=<bytes/sec>. Each full write to a
+ * terminal (or pipe, or socket) big enough to tell anything is timed
+ * under the output lock, less what TIOCOUTQ or FIONREAD says is still
+ * queued, and folded into a build-wide estimate of how fast it
+ * drains; samples are capped at four times the threshold so a burst
+ * into an empty buffer can't outweigh the rest. Below
+ * the threshold the terminal is sent just headlines and failures
+ * while the tee (or SYNCSH_LOCKD log) still gets everything, except
+ * for a full write every SINK_PROBE to see if it has recovered; at
+ * twice the threshold it's back to full output.
+ */
+#define SINK_SAMPLE	4096	/* bytes */
+#define SINK_PROBE	2000000	/* usec */
+
+static long long
+sink_threshold(int fd)
+{
+    const char *env = getenv(PFX "SLOWSINK");
+    struct stat st;
+    long long n;
+
+    if (!env)
+	return 0;
+    if ((n = parse_size(env)) <= 0) {
+	fprintf(stderr, "%s: Error: bad %s '%s'\n", prog, PFX "SLOWSINK", env);
+	return 0;
+    }
+    if (fstat(fd, &st) == -1 || S_ISREG(st.st_mode))
+	return 0;
+
+    return n;
+}
+
+/* Bytes written but not yet taken by the reader, where that's known. */
+static int64_t
+sink_queued(int fd)
+{
+    struct stat st;
+    int n;
+
+    if (fstat(fd, &st) == -1)
+	return 0;
+    if (S_ISFIFO(st.st_mode) && ioctl(fd, FIONREAD, &n) != -1)
+	return n;
+#ifdef TIOCOUTQ
+    if (!S_ISFIFO(st.st_mode) && ioctl(fd, TIOCOUTQ, &n) != -1)
+	return n;
+#endif
+    return 0;
+}
+
+/* A line for the terminal in place of the job's output. */
+static char *
+sink_summary(struct syncsh_job *j, struct plan *pl)
+{
+    size_t n = strcspn(j->recipe, "\n");
+    char *line;
+
+    if (pl->headline)
+	return strdup(pl->headline);
+    if (asprintf(&line, "%s: done: %.*s%s (%lld bytes)\n", prog,
+		 n > 60 ? 60 : (int)n, j->recipe, n > 60 ? "..." : "",
+		 (long long)(j->stats.outbytes + j->stats.errbytes)) == -1)
+	return NULL;
+
+    return line;
+}
+
+/*
+ * Fold a timed write of 'bytes' into the estimate, switching views
+ * as need be. Called with the output lock held.
+ */
+static void
+sink_measure(long long limit, int fd, int64_t bytes, int64_t queued,
+	     int64_t elapsed, const char *log)
+{
+    char msg[PATH_MAX + 128];
+    int64_t sample;
+    int n = 0;
+
+    if (bytes < SINK_SAMPLE)
+	return;
+    if ((bytes += queued - sink_queued(fd)) < 0)
+	bytes = 0;
+    sample = bytes * 1000000 / (elapsed > 1000 ? elapsed : 1000);
+    if (sample > 4 * limit)
+	sample = 4 * limit;
+    shm->sink_rate = shm->sink_rate ? (shm->sink_rate + sample) / 2 : sample;
+    if (!shm->sink_slow && shm->sink_rate < limit) {
+	shm->sink_slow = 1;
+	shm->sink_probe = now_us();
+	n = snprintf(msg, sizeof(msg), "%s: terminal is slow (%lld bytes/sec), "
+		     "showing headlines and failures only, all output is in %s\n",
+		     prog, (long long)shm->sink_rate, log);
+    } else if (shm->sink_slow && shm->sink_rate >= 2 * limit) {
+	shm->sink_slow = 0;
+	n = snprintf(msg, sizeof(msg), "%s: terminal has caught up, "
+		     "showing all output again\n", prog);
+    }
+    if (n > 0)
+	write(STDERR_FILENO, msg, n < (int)sizeof(msg) ? n : (int)sizeof(msg) - 1);
+}
+
+int
+syncsh_publish(syncsh_job_t *j)
+{
+    struct plan pl;
+    struct timespec ts;
+    char *tee, *headline, *lockd = getenv(PFX "LOCKD");
+    char *diags = getenv(PFX "DIAGS");
+    int locked = 0, stalled = 0, rc = 0, i;
+    int shard = tee_shard(j);
+    int engine = replay_engine();
+    int64_t waitstart, deadline = 0;
+    int64_t lockwait = env_usec(PFX "LOCKWAIT");
+    int64_t writewait = env_usec(PFX "WRITEWAIT");
+    unsigned long long teeseq = 0;
+    int statusonly = 0;
+    int64_t shownbytes;
+    long long slowsink = 0;
+    int64_t sinkbytes = 0, sinkq = 0, sinkstart;
+#ifdef HAVE_IO_URING
+    struct uring ring;
+
+    ring.fd = -1;
+#endif
+
+    memset(&pl, 0, sizeof(pl));
+    pl.fd[SINK_OUT] = fileno(stdout);
+    pl.fd[SINK_ERR] = fileno(stderr);
+    pl.fd[SINK_TEE] = -1;
+    pl.nbfd[SINK_OUT] = pl.nbfd[SINK_ERR] = pl.nbfd[SINK_TEE] = -1;
+    if ((tee = getenv(PFX "TEE"))) {
+	if (!is_absolute(tee)) {
+	    fprintf(stderr, "%s: Error: '%s' not an absolute path\n",
+		    prog, tee);
+	    return -1;
+	}
+	/* O_APPEND: each writev() lands at the end, so no lseek(). */
+	if (shard < 0)
+	    pl.fd[SINK_TEE] = open(tee, O_APPEND | O_WRONLY | O_CREAT, 0644);
+	else if (engine == REPLAY_PUMP)
+	    engine = REPLAY_WRITEV;	/* the shard is written from the views */
+    }
+    if ((headline = getenv(PFX "HEADLINE")) && asprintf(&pl.headline, "%s\n",
+							 headline) == -1)
+	pl.headline = NULL;
+    if (writewait) {
+	/* Only the writev engine knows how to give up on a sink. */
+	engine = REPLAY_WRITEV;
+	pl.nbfd[SINK_OUT] = sink_nonblock(pl.fd[SINK_OUT]);
+	pl.nbfd[SINK_ERR] = sink_nonblock(pl.fd[SINK_ERR]);
+    }
+    if (j->rd) {
+	/* Nor how to follow the iovecs with the arena. */
+	engine = REPLAY_WRITEV;
+	if ((pl.scratch = malloc(CHUNK_SIZE)))
+	    pl.rd = j->rd;
+	else
+	    syserr(0, "malloc");
+    }
+    if ((lockd || diags) && engine == REPLAY_PUMP)
+	engine = REPLAY_WRITEV;	/* the upload and filter work from the views */
+    if ((tee || lockd) && (slowsink = sink_threshold(pl.fd[SINK_OUT]))
+	&& !shm_attach(j->syncfd))
+	slowsink = 0;
+    if (slowsink && engine == REPLAY_PUMP)
+	engine = REPLAY_WRITEV;	/* which can swap in a summary */
+#ifdef HAVE_IO_URING
+    if (engine == REPLAY_URING && uring_open(&ring, SINKS) == -1
+	&& getenv(PFX "DEBUG"))
+	fprintf(stderr, "%s: io_uring unavailable, using writev\n", prog);
+#endif
+    if (engine != REPLAY_PUMP
+	&& (view_open(&pl.out, j->out) == -1
+	    || view_open(&pl.err, j->err != j->out ? j->err : NULL) == -1))
+	syserr(0, "capture");
+
+    if (j->lines) {
+	/* The terminal has had it all as it came. */
+	diags = NULL;
+	statusonly = 1;
+	pl.quiet = 1;
+    }
+    if (diags && (j->stats.outbytes || j->stats.errbytes)
+	&& diag_plan(&pl, diags) == -1)
+	diags = NULL;
+    if (diags && (j->stats.outbytes || j->stats.errbytes)) {
+	shownbytes = pl.nshown[0] + pl.nshown[1];
+    } else {
+	shownbytes = j->stats.outbytes + j->stats.errbytes;
+    }
+    if (j->status_slot >= 0 && !j->lines) {
+	/* Quiet success is left to the status line. */
+	if (!j->stats.exitcode && !shownbytes)
+	    statusonly = 1;
+	else
+	    plan_add(&pl, SINK_OUT, (void *)status_erase, sizeof(status_erase) - 1);
+    }
+    if (pl.headline) {
+	if (!statusonly)
+	    plan_add(&pl, SINK_OUT, pl.headline, strlen(pl.headline));
+	plan_add(&pl, SINK_TEE, pl.headline, strlen(pl.headline));
+    }
+    if (diags) {
+	plan_add(&pl, SINK_OUT, pl.shown[0], pl.nshown[0]);
+	plan_add(&pl, SINK_ERR, pl.shown[1], pl.nshown[1]);
+    } else if (!j->lines) {
+	plan_add(&pl, SINK_OUT, pl.out.p, pl.out.len);
+	plan_add(&pl, SINK_ERR, pl.err.p, pl.err.len);
+    }
+    plan_add(&pl, SINK_TEE, pl.out.p, pl.out.len);
+    plan_add(&pl, SINK_TEE, pl.err.p, pl.err.len);
+
+    waitstart = now_us();
+    if (lockwait) {
+	deadline = waitstart + lockwait;
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = deadline % 1000000 * 1000;
+    }
+    if (statusonly && !pl.niov[SINK_TEE] && shard < 0 && !lockd
+	&& !(j->lines && pl.rd && pl.fd[SINK_TEE] >= 0)) {
+	/* Nothing to write anywhere. */
+    } else if (!j->sem) {
+	if (!(lockwait ? pthread_mutex_timedlock(&output_mutex, &ts)
+	      : pthread_mutex_lock(&output_mutex))) {
+	    locked = 1;
+	    if (!(j->sem = lockd ? lockd_acquire(j, &pl, lockd, deadline)
+		  : acquire_semaphore(j, &j->fl, 0, deadline))
+		&& errno != ETIMEDOUT)
+		rc = -1;
+	}
+	if (!j->sem && !rc) {
+	    /* Timed out: the tee is a file and can have its share now. */
+	    j->stats.lockwait = now_us() - waitstart;
+	    if (pl.niov[SINK_TEE])
+		writev_by(pl.fd[SINK_TEE], &pl.next[SINK_TEE],
+			  &pl.niov[SINK_TEE], 0);
+	    if (pl.rd)
+		replay_arena(&pl, 0);
+	    spool_write(j, &pl, "output lock timed out");
+	    j->stats.spooled = 1;
+	    if (tee && shard >= 0)
+		teeseq = tee_shard_seq(j);
+	}
+    }
+    if (locked && j->sem) {
+	j->stats.lockhold = now_us();
+	j->stats.lockwait = j->stats.lockhold - waitstart;
+	if (writewait)
+	    pl.deadline = j->stats.lockhold + writewait;
+	if (tee && shard >= 0)
+	    teeseq = tee_shard_seq(j);
+	if (slowsink && shm->sink_slow && !j->stats.exitcode && !statusonly
+	    && now_us() - shm->sink_probe < SINK_PROBE
+	    && (pl.summary = sink_summary(j, &pl))) {
+	    /* Only the tee's plan stands. */
+	    pl.niov[SINK_OUT] = pl.niov[SINK_ERR] = 0;
+	    plan_add(&pl, SINK_OUT, pl.summary, strlen(pl.summary));
+	    pl.quiet = 1;
+	    j->stats.summarized = 1;
+	} else if (slowsink) {
+	    sinkbytes = j->stats.outbytes + j->stats.errbytes;
+	    sinkq = sink_queued(pl.fd[SINK_OUT]);
+	    if (shm->sink_slow)
+		shm->sink_probe = now_us();
+	}
+	sinkstart = now_us();
+
+	/*
+	 * We've entered the "critical section" during which a lock is held.
+	 * We want to keep it as short as possible.
+	 */
+	if (engine == REPLAY_PUMP)
+	    replay_pump(j, &pl);
+#ifdef HAVE_IO_URING
+	else if (ring.fd != -1)
+	    replay_uring(&ring, &pl);
+#endif
+	else
+	    replay_writev(&pl);
+	if (pl.rd)
+	    replay_arena(&pl, 1);
+	stalled = pl.niov[SINK_OUT] || pl.niov[SINK_ERR]
+	    || pl.stall[0].c || pl.stall[1].c;
+	if (sinkbytes && !stalled)
+	    sink_measure(slowsink, pl.fd[SINK_OUT], sinkbytes, sinkq,
+			 now_us() - sinkstart, tee ? tee : lockd);
+	if (j->status_slot >= 0 && !statusonly)
+	    status_draw(j, 1, 0);
+    }
+
+    /* Exit the critical section */
+    if (j->sem) {
+	if (j->lockfd != -1) {
+	    close(j->lockfd);
+	    j->lockfd = -1;
+	} else {
+	    release_semaphore(j, j->sem);
+	}
+	j->sem = NULL;
+	if (j->stats.lockhold) {
+	    j->stats.lockhold = now_us() - j->stats.lockhold;
+	    if (getenv(PFX "DEBUG"))
+		fprintf(stderr, "%s: held output lock %lldus for '%s'\n",
+			prog, (long long)j->stats.lockhold, j->recipe);
+	}
+    }
+    if (locked)
+	pthread_mutex_unlock(&output_mutex);
+    if (tee && shard >= 0 && !rc)
+	tee_shard_write(j, &pl, tee, shard, teeseq ? teeseq : tee_shard_seq(j));
+    if (j->evfd >= 0 && !rc)
+	event_publish(j, &pl);
+    if (stalled) {
+	spool_write(j, &pl, "output stalled");
+	j->stats.spooled = 2;
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring.fd != -1)
+	uring_close(&ring);
+#endif
+    view_close(&pl.out);
+    view_close(&pl.err);
+    free(pl.scratch);
+    free(pl.headline);
+    free(pl.summary);
+    free(pl.shown[0]);
+    free(pl.shown[1]);
+    if (pl.fd[SINK_TEE] != -1)
+	close(pl.fd[SINK_TEE]);
+    for (i = 0; i < SINKS; i++)
+	if (pl.nbfd[i] != -1)
+	    close(pl.nbfd[i]);
+
+    return rc;
+}
+
+int
+syncsh_end(syncsh_job_t *j)
+{
+    char *statsdir;
+    int statsfd;
+    int exitcode = j->stats.exitcode;
+
+    job_release(j);
+
+    if (j->evfd >= 0) {
+	struct syncsh_ev_exit ex;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.status = exitcode;
+	ex.flags = (j->hit ? SYNCSH_EVF_REPLAYED : 0)
+	    | (j->stats.spooled ? SYNCSH_EVF_SPOOLED : 0)
+	    | (j->evtrunc ? SYNCSH_EVF_TRUNCATED : 0);
+	ex.wall = now_us() - j->stats.start;
+	ex.user = (int64_t) j->stats.ru.ru_utime.tv_sec * 1000000 + j->stats.ru.ru_utime.tv_usec;
+	ex.sys = (int64_t) j->stats.ru.ru_stime.tv_sec * 1000000 + j->stats.ru.ru_stime.tv_usec;
+	ex.outbytes = j->stats.outbytes;
+	ex.errbytes = j->stats.errbytes;
+	event_send(j, SYNCSH_EV_EXIT, 0, &ex, sizeof(ex));
+    }
+
+#ifdef __linux__
+    if (j->procs_on && getenv(PFX "DEBUG"))
+	procs_debug(j);
+#endif
+
+    if ((statsdir = getenv(PFX "STATS"))
+	&& (statsfd = record_open(statsdir)) != -1) {
+	j->stats.end = now_us();
+	record_stats(j, statsfd);
+#ifdef __linux__
+	procs_record(j, statsfd);
+#endif
+	close(statsfd);
+    }
+    job_free(j);
+
+    return exitcode;
+}
+
+/*
+ * Memoized $(shell ...) calls, SYNCSH_MEMO=<regexp>. A recursive build
+ * evaluates the same $(shell git describe) or $(shell pkg-config ...)
+ * in every sub-make. Commands matching <regexp> (and not matching
+ * SYNCSH_NOMEMO) are looked up by their text, flags, the cwd, PATH
+ * and any variables named in the comma-separated SYNCSH_MEMOENV in a
+ * table kept in an mmap()ed file beside the shared state. On a hit
+ * the recorded stdout and exit status are replayed; otherwise the
+ * command runs and its result is recorded if it fits a slot. stderr
+ * isn't recorded, so it's only seen the first time. The table belongs
+ * to one build, the top-level make (or SYNCSH_BUILD), and is cleared
+ * by the first call from any other, so entries don't outlive it unless
+ * SYNCSH_BUILD stays the same. Calls which miss at the same time all
+ * run; the first to finish is recorded.
+ */
+#define MEMO_MAGIC	0x53594e4d
+#define MEMO_SLOTS	1024
+#define MEMO_PROBES	16
+#define MEMO_DATA	(4096 - 16)
+
+struct memo_slot {
+    uint64_t key;		/* 0 = free */
+    int32_t status;
+    uint32_t len;
+    char data[MEMO_DATA];
+};
+
+struct memo_table {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t build;
+    struct memo_slot slot[MEMO_SLOTS];
+};
+
+/*
+ * Make runs a recipe with MAKELEVEL one more than its own but a
+ * $(shell ...) call with its own, which is the only way to tell them
+ * apart in a sub-make. Either way make must be the parent: a recipe
+ * running $(SHELL) -c itself has the recipe's MAKELEVEL.
+ */
+static int
+memo_function(void)
+{
+    char *level = getenv("MAKELEVEL");
+#ifdef __linux__
+    char parent[32];
+
+    if (!proc_is_make(getppid()))
+	return 0;
+    if (level && proc_makelevel(getppid(), parent, sizeof(parent)))
+	return !strcmp(level, parent);
+#endif
+
+    return !level;
+}
+
+static uint64_t
+memo_key(const char *shell, const char *flags, const char *command)
+{
+    char cwd[PATH_MAX], name[256], *env = getenv(PFX "MEMOENV"), *val;
+    uint64_t key;
+    size_t n;
+
+    key = str_hash64(command, strlen(command));
+    key = key * 0x100000001b3ULL ^ str_hash64(shell, strlen(shell));
+    key = key * 0x100000001b3ULL ^ str_hash64(flags, strlen(flags));
+    if (getcwd(cwd, sizeof(cwd)))
+	key = key * 0x100000001b3ULL ^ str_hash64(cwd, strlen(cwd));
+    if ((val = getenv("PATH")))
+	key = key * 0x100000001b3ULL ^ str_hash64(val, strlen(val));
+    for (; env && *env; env += n + (env[n] == ',')) {
+	n = strcspn(env, ",");
+	snprintf(name, sizeof(name), "%.*s", (int)n, env);
+	val = getenv(name);
+	key = key * 0x100000001b3ULL ^ (val ? str_hash64(val, strlen(val)) : 0);
+    }
+
+    return key ? key : 1;
+}
+
+/* Whether SYNCSH_MEMO matches and SYNCSH_NOMEMO doesn't. */
+static int
+memo_wanted(const char *command)
+{
+    char *allow = getenv(PFX "MEMO"), *deny = getenv(PFX "NOMEMO");
+    regex_t re;
+    int match;
+
+    if (!allow || regcomp(&re, allow, REG_EXTENDED | REG_NOSUB)) {
+	if (allow)
+	    fprintf(stderr, "%s: Error: bad regular expression '%s'\n", prog, allow);
+	return 0;
+    }
+    match = !regexec(&re, command, 0, NULL, 0);
+    regfree(&re);
+    if (!match || !deny)
+	return match;
+    if (regcomp(&re, deny, REG_EXTENDED | REG_NOSUB)) {
+	fprintf(stderr, "%s: Error: bad regular expression '%s'\n", prog, deny);
+	return 0;
+    }
+    match = regexec(&re, command, 0, NULL, 0);
+    regfree(&re);
+
+    return match;
+}
+
+static struct memo_table *
+memo_map(int *fdp)
+{
+    char path[PATH_MAX], *state = getenv(PFX "STATE");
+    char *syncfile = getenv(PFX "SYNCFILE");
+    struct memo_table *t;
+    int fd, syncfd = fileno(stderr);
+
+    if (state && is_absolute(state)) {
+	snprintf(path, sizeof(path), "%s.memo", state);
+    } else {
+	if (syncfile && is_absolute(syncfile))
+	    syncfd = open(syncfile, O_RDONLY | O_CLOEXEC);
+	if (syncfd == -1 || sync_path(syncfd, "memo", path, sizeof(path)) == -1)
+	    return NULL;
+	if (syncfd != fileno(stderr))
+	    close(syncfd);
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) == -1) {
+	syserr(0, path);
+	return NULL;
+    }
+    flock(fd, LOCK_EX);
+    if (ftruncate(fd, sizeof(*t)) == -1
+	|| (t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		     0)) == MAP_FAILED) {
+	syserr(0, path);
+	close(fd);
+	return NULL;
+    }
+    *fdp = fd;
+
+    return t;
+}
+
+static struct memo_slot *
+memo_find(struct memo_table *t, uint64_t key, int insert)
+{
+    struct memo_slot *s;
+    int i;
+
+    for (i = 0; i < MEMO_PROBES; i++) {
+	s = &t->slot[(key + i) % MEMO_SLOTS];
+	if (s->key == key)
+	    return s;
+	if (!s->key)
+	    return insert ? s : NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the command with its stdout collected in 'out', of MEMO_DATA
+ * bytes. If there's more than that, all of it is passed on to stdout
+ * as it comes and '*spilled' is set, as it couldn't be recorded
+ * anyway. Returns the command's exit status, or -1 if it couldn't be
+ * run or its output couldn't all be read before any was passed on.
+ */
+static int
+memo_run(const char *shell, const char *flags, const char *command,
+	 char *out, size_t *len, int *spilled)
+{
+    char more[4096];
+    int fds[2], status, broken = 0, werr = 0;
+    ssize_t n;
+    pid_t pid;
+
+    *len = 0;
+    *spilled = 0;
+    if (pipe(fds) == -1)
+	return -1;
+    if ((pid = fork()) == -1) {
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+    }
+    if (pid == 0) {
+	close(fds[0]);
+	if (dup2(fds[1], STDOUT_FILENO) == -1)
+	    _exit(127);
+	close(fds[1]);
+	execlp(shell, shell, flags, command, (char *)NULL);
+	perror(shell);
+	_exit(127);
+    }
+    close(fds[1]);
+    while (*len < MEMO_DATA) {
+	EINTR_CHECK(n, read(fds[0], out + *len, MEMO_DATA - *len));
+	if (n <= 0) {
+	    broken = n < 0;
+	    break;
+	}
+	*len += n;
+    }
+    while (*len == MEMO_DATA && !broken) {
+	/* Too big to record: pass it on as it comes. */
+	EINTR_CHECK(n, read(fds[0], more, sizeof(more)));
+	if (n <= 0)
+	    break;
+	if (!*spilled) {
+	    *spilled = 1;
+	    werr = write_all(STDOUT_FILENO, out, *len) ? errno : 0;
+	}
+	if (!werr && write_all(STDOUT_FILENO, more, n))
+	    werr = errno;
+    }
+    close(fds[0]);
+    if (werr) {
+	errno = werr;
+	syserr(0, "write(stdout)");
+    }
+    while (waitpid(pid, &status, 0) == -1)
+	if (errno != EINTR)
+	    return *spilled ? 127 : -1;
+    if (broken)
+	return -1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * The recorded result, or the command's own. Anything which goes wrong
+ * before output is given returns -1, so that the command is run as if
+ * it weren't memoized; nothing partial is ever recorded or replayed.
+ */
+int
+syncsh_memo(const char *shell, const char *flags, const char *command)
+{
+    struct memo_table *t;
+    struct memo_slot *s;
+    uint64_t build, key;
+    char out[MEMO_DATA];
+    size_t len;
+    int fd, rc, spilled = 0;
+
+    if (!memo_function() || !memo_wanted(command) || !(build = build_id())
+	|| !(t = memo_map(&fd)))
+	return -1;
+    key = memo_key(shell, flags, command);
+    if (t->magic != MEMO_MAGIC || t->build != build) {
+	memset(t, 0, sizeof(*t));
+	t->magic = MEMO_MAGIC;
+	t->build = build;
+    }
+    if ((s = memo_find(t, key, 0)) && s->len <= MEMO_DATA) {
+	rc = s->status;
+	len = s->len;
+	memcpy(out, s->data, len);
+	flock(fd, LOCK_UN);
+	if (getenv(PFX "DEBUG"))
+	    fprintf(stderr, "%s: memoized '%s'\n", prog, command);
+    } else {
+	/* Not held while it runs, as it may well run make itself. */
+	flock(fd, LOCK_UN);
+	if ((rc = memo_run(shell, flags, command, out, &len, &spilled)) == -1) {
+	    munmap(t, sizeof(*t));
+	    close(fd);
+	    return -1;
+	}
+	if (!spilled) {
+	    flock(fd, LOCK_EX);
+	    if (t->build == build && (s = memo_find(t, key, 1)) && !s->key) {
+		s->status = rc;
+		s->len = len;
+		memcpy(s->data, out, len);
+		s->key = key;
+		t->count++;
+	    }
+	    flock(fd, LOCK_UN);
+	}
+    }
+    munmap(t, sizeof(*t));
+    close(fd);
+    if (!spilled && len && write_all(STDOUT_FILENO, out, len))
+	syserr(0, "write(stdout)");
+
+    return rc;
+}
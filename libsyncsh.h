@@ -0,0 +1,188 @@
+/*
+ * libsyncsh - the capture, lock and replay engine behind syncsh, for
+ * build drivers and test runners which want the same atomic-output
+ * guarantees in-process without running every job through syncsh.
+ * The syncsh binary itself is a thin client of this library.
+ *
+ * A job goes through
+ *
+ *     j = syncsh_begin(recipe, shell, 0);
+ *     if (!syncsh_replayed(j))
+ *         syncsh_spawn(j, argv);      (or write to syncsh_fd(j, 1|2))
+ *     syncsh_finish(j, status);
+ *     syncsh_publish(j);
+ *     exitcode = syncsh_end(j);
+ *
+ * and honours the same SYNCSH_* environment variables as syncsh
+ * (classes, cache, coalescing, caps, pinning, cgroups, stats and
+ * so on), read when the job begins. Jobs in different processes
+ * synchronize through fcntl() locks exactly as syncsh instances do.
+ * Jobs in different threads of one process also exclude each other
+ * while publishing and while updating the shared state, but the
+ * SERIALIZE lock, class caps and coalescing only coordinate between
+ * processes.
+ */
+#ifndef LIBSYNCSH_H
+#define LIBSYNCSH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct syncsh_job syncsh_job_t;
+
+/*
+ * The job may change process-wide state: become a child subreaper
+ * and reap any child (SYNCSH_PROCS needs this), which only suits a
+ * process running one job at a time, as syncsh does.
+ */
+#define SYNCSH_OWN_PROCESS	0x1
+
+/* Name to prefix messages with; the default is "syncsh". */
+void syncsh_progname(const char *name);
+
+/*
+ * Start a job for 'recipe', the text identifying it (and hashed into
+ * cache and coalescing keys along with 'shell' and the cwd). This
+ * looks the job up in the cache and among identical running jobs,
+ * takes any SERIALIZE lock and class cap, and sets up the capture
+ * files. Returns NULL on failure.
+ */
+syncsh_job_t *syncsh_begin(const char *recipe, const char *shell, int flags);
+
+/* Non-zero if the job's result was replayed and it need not run. */
+int syncsh_replayed(syncsh_job_t *j);
+
+/*
+ * The descriptor to which stream 1 (stdout) or 2 (stderr) of the
+ * job should be written: a capture file, or the real stream when
+ * the job is serialized.
+ */
+int syncsh_fd(syncsh_job_t *j, int stream);
+
+/*
+ * Run argv[0] (found in PATH) with the job's capture files (or with
+ * SYNCSH_CAPTURE=compress, pipes to its capture arena) as its stdout
+ * and stderr and the job's class attributes, cpu pinning and cgroup
+ * applied. With SYNCSH_ADMIT it first waits until the recipe's
+ * expected memory fits the budget. Returns the child's pid, 0 if the
+ * job was replayed or -1 on failure.
+ */
+pid_t syncsh_spawn(syncsh_job_t *j, char *const argv[]);
+
+/*
+ * Finish running the job. A child from syncsh_spawn() is waited for;
+ * otherwise 'status' is the job's wait(2) status (an exit code 'n'
+ * is n << 8). Releases the class cap, collects cgroup figures and
+ * stores the result for the cache and any coalesced waiters. Returns
+ * the job's exit code.
+ */
+int syncsh_finish(syncsh_job_t *j, int status);
+
+/*
+ * Write the captured output to stdout, stderr and SYNCSH_TEE as one
+ * uninterrupted block under the output lock. Returns 0, or -1 if
+ * the lock could not be taken.
+ */
+int syncsh_publish(syncsh_job_t *j);
+
+/*
+ * Release everything held by the job, write its SYNCSH_STATS records
+ * and free it. Returns the job's exit code.
+ */
+int syncsh_end(syncsh_job_t *j);
+
+/*
+ * With SYNCSH_DIAGS=<set>, make the warning fingerprints collected in
+ * <set>.new during a build the ones later builds count as known, as
+ * after a successful build. Returns how many there are, or -1 with
+ * errno set.
+ */
+int syncsh_diags_save(const char *set);
+
+/*
+ * The line scanner syncsh post-processes output with, for drivers
+ * doing the same. Splits p[0..len) into up to 'max' lines, each
+ * with its newline (the last may have none), and returns how many.
+ * A line's flags have SYNCSH_SCAN_ESC if it has escape sequences
+ * (ANSI colours and so on) and SYNCSH_SCAN_QUOTE if it has other bytes
+ * a quoted string must escape: control characters, DEL, '"' and '\\'.
+ * The scan uses AVX2 or SSE2 where the cpu has them;
+ * SYNCSH_SCAN=avx2|sse2|portable picks one.
+ */
+#define SYNCSH_SCAN_ESC		0x1
+#define SYNCSH_SCAN_QUOTE	0x2
+
+struct syncsh_line {
+    size_t len;
+    unsigned flags;
+};
+
+size_t syncsh_scan_lines(const char *p, size_t len, struct syncsh_line *line,
+			 size_t max);
+
+/* The name of the kernel the scan uses: "avx2", "sse2" or "portable". */
+const char *syncsh_scan_kernel(void);
+
+/*
+ * With SYNCSH_MEMO=<regexp>, run a make function call ("shell flags
+ * command", from $(shell ...) rather than a recipe) whose command
+ * matches, or replay its stdout and exit status if the same call was
+ * already made in this build. Returns the exit code, or -1 if the
+ * call is not one to memoize and should be run as usual.
+ */
+int syncsh_memo(const char *shell, const char *flags, const char *command);
+
+/*
+ * Live events. With SYNCSH_EVENTS naming a broker's socket (see
+ * "syncsh broker") each job sends these over a SOCK_SEQPACKET
+ * connection, never waiting: if the broker is behind, events are
+ * dropped. Subscribers receive them back to back on a stream. All
+ * fields are in host byte order.
+ */
+enum {
+    SYNCSH_EV_START = 1,	/* payload: the recipe text */
+    SYNCSH_EV_OUTPUT,		/* payload: output bytes of 'stream' */
+    SYNCSH_EV_LOCK,		/* payload: struct syncsh_ev_lock */
+    SYNCSH_EV_EXIT,		/* payload: struct syncsh_ev_exit */
+    SYNCSH_EV_LOST		/* payload: uint64_t count (from the broker) */
+};
+
+struct syncsh_event {
+    uint16_t len;		/* of the event, header included */
+    uint8_t type;		/* SYNCSH_EV_* */
+    uint8_t stream;		/* 1 or 2, for output */
+    uint32_t pid;		/* of the publishing process */
+    uint32_t seq;		/* per job, so losses can be spotted */
+    uint32_t job;		/* distinguishes a process's jobs */
+    int64_t t;			/* wall clock, usec */
+};
+
+struct syncsh_ev_lock {
+    int64_t wait, hold;		/* usec */
+};
+
+struct syncsh_ev_exit {
+    int32_t status;		/* exit code */
+    int32_t flags;		/* SYNCSH_EVF_* */
+    int64_t wall, user, sys;	/* usec */
+    int64_t outbytes, errbytes;
+};
+
+#define SYNCSH_EVF_REPLAYED	0x1	/* from the cache or a coalesced job */
+#define SYNCSH_EVF_SPOOLED	0x2	/* output went to the spool */
+#define SYNCSH_EVF_TRUNCATED	0x4	/* not all output was sent as events */
+
+#define SYNCSH_EV_MAX		16384	/* largest event */
+
+/* The clock events and stats records are stamped with, in usec. */
+int64_t syncsh_now_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBSYNCSH_H */
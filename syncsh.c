@@ -1,5 +1,7 @@
 /*
  * "syncsh" - See associated README for documentation.
+ * This is a thin client of libsyncsh, which does the real work,
+ * plus the offline "metrics" and "report" analyzers.
  * This is written to the POSIX API and should work
  * on just about any Unix-like system.
  * I know of no reason it couldn't be ported to Windows;
@@ -15,37 +17,37 @@
  * faster.
  */
 
-#include <ctype.h>
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <limits.h>
 #include <libgen.h>
+#include <netdb.h>
+#include <poll.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/file.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
-
-#define PFX			"SYNCSH_"
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-#define STREAM_OK(strm)		((fcntl(fileno((strm)), F_GETFD) != -1) || (errno != EBADF))
+#include "libsyncsh.h"
 
-#ifdef EINTR
-#define EINTR_CHECK(lhs,fcn)	while (((lhs)=fcn) == -1 && errno == EINTR)
-#else
-#define EINTR_CHECK(lhs,fcn)	((lhs) = (fcn))
-#endif
+#define PFX			"SYNCSH_"
 
 #define is_absolute(path)	(*path == '/')
 
 static char *prog = "??";
-static char *recipe = "???";
 
 static void
 syserr_(const char *f, int l, int code, const char *ex)
@@ -87,13 +89,50 @@ usage(void)
 
     fprintf(stderr, "Usage: %s -<flags> <command>\n", prog);
     fprintf(stderr, "  " "where <flags> will typically be -c\n");
+    fprintf(stderr, "   or: %s metrics [-b <build>] <statsdir> <file>\n", prog);
+    fprintf(stderr, "   or: %s report [-b <build>] <statsdir>\n", prog);
+    fprintf(stderr, "   or: %s log merge <tee>\n", prog);
+    fprintf(stderr, "   or: %s log query [-r <regexp>] [-g <regexp>] <tee>\n", prog);
+    fprintf(stderr, "   or: %s broker <socket>\n", prog);
+    fprintf(stderr, "   or: %s events <socket>\n", prog);
+    fprintf(stderr, "   or: %s lockd <socket>|<host>:<port> [<log>]\n", prog);
+    fprintf(stderr, "   or: %s diags save <set>\n", prog);
+    fprintf(stderr, "   or: %s scan <file>\n", prog);
     fprintf(stderr, "Environment variables:\n");
+    fprintf(stderr, fmt, PFX "ADMIT:", "memory for recipes, <size>|<n>%[:<default>]");
+    fprintf(stderr, fmt, PFX "BUILD:", "build id stamped on stats records");
+    fprintf(stderr, fmt, PFX "CACHE:", "directory for cached recipe output");
+    fprintf(stderr, fmt, PFX "CAPS:", "per-class caps, e.g. link=2,test=4");
+    fprintf(stderr, fmt, PFX "CAPTURE:", "capture to 'file' (default), 'memory' or 'compress[:<size>]'");
+    fprintf(stderr, fmt, PFX "CGROUP:", "run recipes in their own cgroups");
+    fprintf(stderr, fmt, PFX "CLASSES:", "file of recipe classification rules");
+    fprintf(stderr, fmt, PFX "COALESCE:", "share results of identical recipes");
+    fprintf(stderr, fmt, PFX "DIAGS:", "show only warnings not in this fingerprint set");
+    fprintf(stderr, fmt, PFX "EVENTS:", "event broker socket to publish to");
     fprintf(stderr, fmt, PFX "HEADLINE:", "string to print before output");
+    fprintf(stderr, fmt, PFX "LINES:", "write lines as they come, tagged with 'pid' or <n> chars");
+    fprintf(stderr, fmt, PFX "LOCKD:", "lock broker, <socket> or <host>:<port>");
+    fprintf(stderr, fmt, PFX "LOCKWAIT:", "seconds to wait for the output lock");
+    fprintf(stderr, fmt, PFX "MEMBUDGET:", "build-wide memory for captured output");
+    fprintf(stderr, fmt, PFX "MEMO:", "pattern for $(shell ...) calls to memoize per build");
+    fprintf(stderr, fmt, PFX "MEMOENV:", "variables, comma-separated, keying memoized calls");
+    fprintf(stderr, fmt, PFX "NOMEMO:", "pattern for $(shell ...) calls never to memoize");
+    fprintf(stderr, fmt, PFX "PIN:", "pin recipes to L3/NUMA cpu domains");
+    fprintf(stderr, fmt, PFX "PROCS:", "track each command in a recipe (ms)");
+    fprintf(stderr, fmt, PFX "REPLAY:", "replay with 'writev' (default), 'uring' or 'pump'");
+    fprintf(stderr, fmt, PFX "SCAN:", "line scanner, 'avx2', 'sse2' or 'portable'");
     fprintf(stderr, fmt, PFX "SERIALIZE:", "pattern for serializable recipes");
     fprintf(stderr, fmt, PFX "SHELL:", "path of shell to hand off to");
+    fprintf(stderr, fmt, PFX "SLOWSINK:", "bytes/sec below which a terminal gets summaries");
+    fprintf(stderr, fmt, PFX "SPOOL:", "file for output which timed out");
+    fprintf(stderr, fmt, PFX "STATE:", "build-wide shared state file");
+    fprintf(stderr, fmt, PFX "STATUS:", "status line for quiet recipes, redrawn every <ms>");
+    fprintf(stderr, fmt, PFX "STATS:", "directory for per-recipe stats records");
     //fprintf(stderr, fmt, PFX "SYNCFILE:", "full path to a writable lock file");
     fprintf(stderr, fmt, PFX "TEE:", "file to which output will be appended");
+    fprintf(stderr, fmt, PFX "TEESHARDS:", "split the tee, <n>[:pid|class|dir]");
     fprintf(stderr, fmt, PFX "VERBOSE:", "print recipe with this prefix");
+    fprintf(stderr, fmt, PFX "WRITEWAIT:", "seconds to let a stalled terminal block");
     exit(1);
 }
 
@@ -108,273 +147,1572 @@ vb(int fd, const char *prefix, char **argv)
     }
 }
 
-static uint16_t
-str_hash(char *str, unsigned len)
+/*
+ * A parsed record. String fields point into the line buffer.
+ */
+struct rec {
+    long pid;
+    int exitcode;
+    int64_t t0, t1, lw, lh, sw, cw, ob, eb, cz, mp, ut, kt, aw, am;
+    long sp, sm, rss;
+    long long cgm, cgc, cgr, cgw;
+    char *type, *build, *hash, *cwd, *recipe, *cmd;
+    char *cls, *cache, *coalesced, *spooled;
+};
+
+static int
+parse_record(char *line, struct rec *r)
+{
+    char *tok, *val, *save = NULL;
+
+    memset(r, 0, sizeof(*r));
+    r->sw = -1;
+    r->cw = -1;
+    r->cz = -1;
+    r->mp = -1;
+    r->aw = -1;
+    line[strcspn(line, "\n")] = '\0';
+    for (tok = strtok_r(line, "\t", &save); tok;
+	 tok = strtok_r(NULL, "\t", &save)) {
+	if (!(val = strchr(tok, '=')))
+	    continue;
+	*val++ = '\0';
+	if (!strcmp(tok, "ty"))
+	    r->type = val;
+	else if (!strcmp(tok, "pid"))
+	    r->pid = atol(val);
+	else if (!strcmp(tok, "st"))
+	    r->exitcode = atoi(val);
+	else if (!strcmp(tok, "t0"))
+	    r->t0 = atoll(val);
+	else if (!strcmp(tok, "t1"))
+	    r->t1 = atoll(val);
+	else if (!strcmp(tok, "lw"))
+	    r->lw = atoll(val);
+	else if (!strcmp(tok, "lh"))
+	    r->lh = atoll(val);
+	else if (!strcmp(tok, "sw"))
+	    r->sw = atoll(val);
+	else if (!strcmp(tok, "cw"))
+	    r->cw = atoll(val);
+	else if (!strcmp(tok, "ob"))
+	    r->ob = atoll(val);
+	else if (!strcmp(tok, "eb"))
+	    r->eb = atoll(val);
+	else if (!strcmp(tok, "cz"))
+	    r->cz = atoll(val);
+	else if (!strcmp(tok, "mp"))
+	    r->mp = atoll(val);
+	else if (!strcmp(tok, "ut"))
+	    r->ut = atoll(val);
+	else if (!strcmp(tok, "kt"))
+	    r->kt = atoll(val);
+	else if (!strcmp(tok, "sp"))
+	    r->sp = atol(val);
+	else if (!strcmp(tok, "rss"))
+	    r->rss = atol(val);
+	else if (!strcmp(tok, "cgm"))
+	    r->cgm = atoll(val);
+	else if (!strcmp(tok, "cgc"))
+	    r->cgc = atoll(val);
+	else if (!strcmp(tok, "cgr"))
+	    r->cgr = atoll(val);
+	else if (!strcmp(tok, "cgw"))
+	    r->cgw = atoll(val);
+	else if (!strcmp(tok, "b"))
+	    r->build = val;
+	else if (!strcmp(tok, "h"))
+	    r->hash = val;
+	else if (!strcmp(tok, "c"))
+	    r->cls = val;
+	else if (!strcmp(tok, "ch"))
+	    r->cache = val;
+	else if (!strcmp(tok, "co"))
+	    r->coalesced = val;
+	else if (!strcmp(tok, "ov"))
+	    r->spooled = val;
+	else if (!strcmp(tok, "sm"))
+	    r->sm = atol(val);
+	else if (!strcmp(tok, "aw"))
+	    r->aw = atoll(val);
+	else if (!strcmp(tok, "am"))
+	    r->am = atoll(val);
+	else if (!strcmp(tok, "d"))
+	    r->cwd = val;
+	else if (!strcmp(tok, "r"))
+	    r->recipe = val;
+	else if (!strcmp(tok, "cmd"))
+	    r->cmd = val;
+    }
+
+    return r->t1 >= r->t0 && r->t1 > 0;
+}
+
+/*
+ * Call 'fn' for each record in the shard files of 'dir', optionally
+ * restricted to one build id. Only one line is in memory at a time.
+ */
+static int
+foreach_record(const char *dir, const char *build,
+	       void (*fn)(struct rec *, void *), void *arg)
 {
-    uint16_t hash = 0;
-    uint16_t i = 0;
+    DIR *dp;
+    struct dirent *de;
+    char path[PATH_MAX];
+    char line[PIPE_BUF + 2];
+    struct rec r;
+    FILE *fp;
+    size_t len;
 
-    for (i = 0; i < len; str++, i++) {
-	hash = (*str) + (hash << 6) + (hash << 16) - hash;
+    if (!(dp = opendir(dir))) {
+	syserr(0, dir);
+	return -1;
     }
+    while ((de = readdir(dp))) {
+	len = strlen(de->d_name);
+	if (len < 5 || strcmp(de->d_name + len - 4, ".rec"))
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	if (!(fp = fopen(path, "r"))) {
+	    syserr(0, path);
+	    continue;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+	    if (!parse_record(line, &r))
+		continue;
+	    if (build && (!r.build || strcmp(build, r.build)))
+		continue;
+	    fn(&r, arg);
+	}
+	fclose(fp);
+    }
+    closedir(dp);
 
-    return hash >> 1;
+    return 0;
+}
+
+/*
+ * Log-scale histogram with 8 buckets per power of two, good to
+ * within ~9% for percentile estimates in constant space.
+ */
+#define LH_BUCKETS	512
+
+struct loghist {
+    uint64_t n[LH_BUCKETS];
+    uint64_t count;
+};
+
+static int
+lh_bucket(int64_t v)
+{
+    int e, b;
+
+    if (v <= 0)
+	return 0;
+    e = 63 - __builtin_clzll((uint64_t) v);
+    b = e * 8 + (int)((e >= 3 ? v >> (e - 3) : v << (3 - e)) & 7) + 1;
+
+    return b < LH_BUCKETS ? b : LH_BUCKETS - 1;
 }
 
 static void
-pump_from_tmp_fd(int from_fd, int to_fd)
+lh_add(struct loghist *lh, int64_t v)
 {
-    ssize_t nleft, nwrite;
-    char buffer[8192];
+    lh->n[lh_bucket(v)]++;
+    lh->count++;
+}
 
-    if (lseek(from_fd, 0, SEEK_SET) == -1)
-	perror("lseek()");
+static int64_t
+lh_quantile(const struct loghist *lh, double q)
+{
+    uint64_t want, seen = 0;
+    int b;
 
-    while (1) {
-	EINTR_CHECK(nleft, read(from_fd, buffer, sizeof(buffer)));
-	if (nleft < 0)
-	    perror("read()");
+    if (!lh->count)
+	return 0;
+    want = (uint64_t) (q * lh->count + 0.5);
+    if (want < 1)
+	want = 1;
+    for (b = 0; b < LH_BUCKETS; b++) {
+	if ((seen += lh->n[b]) >= want)
+	    break;
+    }
+    if (b == 0)
+	return 0;
+    b--;
+
+    /* midpoint of the bucket */
+    return ((int64_t) (2 * (8 + (b & 7)) + 1) << (b / 8)) >> 4;
+}
+
+static const double metric_le[] = { 0.0001, 0.001, 0.01, 0.1, 1, 10 };
+#define N_LE	(sizeof(metric_le) / sizeof(metric_le[0]))
+
+struct metrics {
+    uint64_t recipes, failures, serialized, spills;
+    uint64_t hits, misses, coalesced;
+    uint64_t spooled_lock, spooled_write;
+    uint64_t summarized;	/* SYNCSH_SLOWSINK */
+    uint64_t capped, capwaits;	/* class caps */
+    int64_t cwsum;
+    uint64_t admitted, admitwaits;	/* SYNCSH_ADMIT */
+    int64_t awsum, ammax;
+    long long cgmax, cgcpu, cgread, cgwrite;
+    int64_t first, last;
+    int64_t dursum, lwsum, lhsum, swsum, ob, eb;
+    int64_t zraw, zheld;	/* SYNCSH_CAPTURE=compress */
+    int64_t mempeak;		/* SYNCSH_MEMBUDGET, or -1 */
+    struct loghist dur;
+    uint64_t lwle[N_LE], lhle[N_LE];
+};
+
+static void
+metrics_add(struct rec *r, void *arg)
+{
+    struct metrics *m = (struct metrics *)arg;
+    unsigned i;
+
+    if (r->type)
+	return;			/* only recipe records count here */
+
+    m->recipes++;
+    if (r->exitcode)
+	m->failures++;
+    if (!m->first || r->t0 < m->first)
+	m->first = r->t0;
+    if (r->t1 > m->last)
+	m->last = r->t1;
+    m->dursum += r->t1 - r->t0;
+    lh_add(&m->dur, r->t1 - r->t0);
+    m->lwsum += r->lw;
+    m->lhsum += r->lh;
+    for (i = 0; i < N_LE; i++) {
+	if (r->lw <= metric_le[i] * 1e6)
+	    m->lwle[i]++;
+	if (r->lh <= metric_le[i] * 1e6)
+	    m->lhle[i]++;
+    }
+    if (r->sw >= 0) {
+	m->serialized++;
+	m->swsum += r->sw;
+    }
+    m->ob += r->ob;
+    m->eb += r->eb;
+    m->spills += r->sp;
+    if (r->mp > m->mempeak)
+	m->mempeak = r->mp;
+    if (r->cz >= 0) {
+	m->zraw += r->ob + r->eb;
+	m->zheld += r->cz;
+    }
+    if (r->cache) {
+	if (!strcmp(r->cache, "hit"))
+	    m->hits++;
 	else
-	    while (nleft > 0) {
-		EINTR_CHECK(nwrite, write(to_fd, buffer, nleft));
-		if (nwrite < 0) {
-		    perror("write()");
-		    return;
-		}
+	    m->misses++;
+    }
+    if (r->coalesced && !strcmp(r->coalesced, "follow"))
+	m->coalesced++;
+    if (r->spooled) {
+	if (!strcmp(r->spooled, "write"))
+	    m->spooled_write++;
+	else
+	    m->spooled_lock++;
+    }
+    if (r->sm)
+	m->summarized++;
+    if (r->cw >= 0) {
+	m->capped++;
+	if (r->cw >= 1000)
+	    m->capwaits++;
+	m->cwsum += r->cw;
+    }
+    if (r->aw >= 0) {
+	m->admitted++;
+	if (r->aw >= 1000)
+	    m->admitwaits++;
+	m->awsum += r->aw;
+	if (r->am > m->ammax)
+	    m->ammax = r->am;
+    }
+    if (r->cgm > m->cgmax)
+	m->cgmax = r->cgm;
+    m->cgcpu += r->cgc;
+    m->cgread += r->cgr;
+    m->cgwrite += r->cgw;
+}
 
-		nleft -= nwrite;
-	    }
+static void
+metrics_histogram(FILE *fp, const char *name, const char *help,
+		  const uint64_t *le, uint64_t count, int64_t sum)
+{
+    unsigned i;
 
-	if (nleft <= 0)
-	    break;
+    fprintf(fp, "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n",
+	    name, name, name, help);
+    for (i = 0; i < N_LE; i++)
+	fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name, metric_le[i],
+		(unsigned long long)le[i]);
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+	    (unsigned long long)count);
+    fprintf(fp, "%s_sum %.6f\n%s_count %llu\n", name, sum / 1e6, name,
+	    (unsigned long long)count);
+}
+
+/*
+ * "syncsh metrics [-b build] <statsdir> <file>": aggregate the
+ * records into an OpenMetrics textfile suitable for the node_exporter
+ * textfile collector. The file is written under a temporary name
+ * and renamed into place so a scrape never sees a partial file.
+ */
+static int
+metrics_main(int argc, char *argv[])
+{
+    static struct metrics m;
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    char tmp[PATH_MAX];
+    char *build = NULL;
+    FILE *fp;
+    unsigned i;
+
+    if (argc > 2 && !strcmp(argv[1], "-b")) {
+	build = argv[2];
+	argc -= 2;
+	argv += 2;
     }
+    m.mempeak = -1;
+    if (argc != 3)
+	usage();
+    if (foreach_record(argv[1], build, metrics_add, &m))
+	return 2;
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", argv[2], (long)getpid());
+    if (!(fp = fopen(tmp, "w")))
+	syserr(2, tmp);
+
+    fprintf(fp, "# TYPE syncsh_recipes counter\n"
+	    "# HELP syncsh_recipes Recipes run under syncsh.\n"
+	    "syncsh_recipes_total %llu\n", (unsigned long long)m.recipes);
+    fprintf(fp, "# TYPE syncsh_recipe_failures counter\n"
+	    "# HELP syncsh_recipe_failures Recipes exiting with non-zero status.\n"
+	    "syncsh_recipe_failures_total %llu\n",
+	    (unsigned long long)m.failures);
+    fprintf(fp, "# TYPE syncsh_recipe_duration_seconds summary\n"
+	    "# UNIT syncsh_recipe_duration_seconds seconds\n"
+	    "# HELP syncsh_recipe_duration_seconds Wall time of each recipe.\n");
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+	fprintf(fp, "syncsh_recipe_duration_seconds{quantile=\"%g\"} %.6f\n",
+		quantiles[i], lh_quantile(&m.dur, quantiles[i]) / 1e6);
+    fprintf(fp, "syncsh_recipe_duration_seconds_sum %.6f\n"
+	    "syncsh_recipe_duration_seconds_count %llu\n",
+	    m.dursum / 1e6, (unsigned long long)m.recipes);
+    metrics_histogram(fp, "syncsh_lock_wait_seconds",
+		      "Time spent waiting for the output lock.",
+		      m.lwle, m.recipes, m.lwsum);
+    metrics_histogram(fp, "syncsh_lock_hold_seconds",
+		      "Time the output lock was held.",
+		      m.lhle, m.recipes, m.lhsum);
+    fprintf(fp, "# TYPE syncsh_serialize_waits counter\n"
+	    "# HELP syncsh_serialize_waits Recipes matching SYNCSH_SERIALIZE.\n"
+	    "syncsh_serialize_waits_total %llu\n"
+	    "# TYPE syncsh_serialize_wait_seconds counter\n"
+	    "# UNIT syncsh_serialize_wait_seconds seconds\n"
+	    "# HELP syncsh_serialize_wait_seconds Time spent waiting for SYNCSH_SERIALIZE locks.\n"
+	    "syncsh_serialize_wait_seconds_total %.6f\n",
+	    (unsigned long long)m.serialized, m.swsum / 1e6);
+    fprintf(fp, "# TYPE syncsh_captured_bytes counter\n"
+	    "# UNIT syncsh_captured_bytes bytes\n"
+	    "# HELP syncsh_captured_bytes Recipe output held back for synchronization.\n"
+	    "syncsh_captured_bytes_total{stream=\"stdout\"} %lld\n"
+	    "syncsh_captured_bytes_total{stream=\"stderr\"} %lld\n",
+	    (long long)m.ob, (long long)m.eb);
+    fprintf(fp, "# TYPE syncsh_capture_spills counter\n"
+	    "# HELP syncsh_capture_spills Captures moved from memory to disk.\n"
+	    "syncsh_capture_spills_total %llu\n",
+	    (unsigned long long)m.spills);
+    fprintf(fp, "# TYPE syncsh_compressed_capture_bytes counter\n"
+	    "# UNIT syncsh_compressed_capture_bytes bytes\n"
+	    "# HELP syncsh_compressed_capture_bytes Output captured by compressing arenas, and the memory it took.\n"
+	    "syncsh_compressed_capture_bytes_total{kind=\"raw\"} %lld\n"
+	    "syncsh_compressed_capture_bytes_total{kind=\"held\"} %lld\n",
+	    (long long)m.zraw, (long long)m.zheld);
+    if (m.mempeak >= 0)
+	fprintf(fp, "# TYPE syncsh_capture_memory_peak_bytes gauge\n"
+		"# UNIT syncsh_capture_memory_peak_bytes bytes\n"
+		"# HELP syncsh_capture_memory_peak_bytes Most captured output held in memory at once under SYNCSH_MEMBUDGET.\n"
+		"syncsh_capture_memory_peak_bytes %lld\n", (long long)m.mempeak);
+    fprintf(fp, "# TYPE syncsh_cache_lookups counter\n"
+	    "# HELP syncsh_cache_lookups Memoization cache lookups by result.\n"
+	    "syncsh_cache_lookups_total{result=\"hit\"} %llu\n"
+	    "syncsh_cache_lookups_total{result=\"miss\"} %llu\n",
+	    (unsigned long long)m.hits, (unsigned long long)m.misses);
+    fprintf(fp, "# TYPE syncsh_coalesced_recipes counter\n"
+	    "# HELP syncsh_coalesced_recipes Recipes which replayed an identical in-flight recipe.\n"
+	    "syncsh_coalesced_recipes_total %llu\n",
+	    (unsigned long long)m.coalesced);
+    fprintf(fp, "# TYPE syncsh_spooled_outputs counter\n"
+	    "# HELP syncsh_spooled_outputs Outputs sent to the overflow spool, by cause.\n"
+	    "syncsh_spooled_outputs_total{cause=\"lock\"} %llu\n"
+	    "syncsh_spooled_outputs_total{cause=\"write\"} %llu\n",
+	    (unsigned long long)m.spooled_lock,
+	    (unsigned long long)m.spooled_write);
+    fprintf(fp, "# TYPE syncsh_summarized_outputs counter\n"
+	    "# HELP syncsh_summarized_outputs Outputs shown as a summary on a slow terminal.\n"
+	    "syncsh_summarized_outputs_total %llu\n",
+	    (unsigned long long)m.summarized);
+    if (m.capped)
+	fprintf(fp, "# TYPE syncsh_class_cap_waits counter\n"
+		"# HELP syncsh_class_cap_waits Recipes held back by a class cap for a millisecond or more.\n"
+		"syncsh_class_cap_waits_total %llu\n"
+		"# TYPE syncsh_class_cap_wait_seconds counter\n"
+		"# UNIT syncsh_class_cap_wait_seconds seconds\n"
+		"# HELP syncsh_class_cap_wait_seconds Time recipes spent waiting under class caps.\n"
+		"syncsh_class_cap_wait_seconds_total %.6f\n",
+		(unsigned long long)m.capwaits, m.cwsum / 1e6);
+    if (m.admitted)
+	fprintf(fp, "# TYPE syncsh_admission_waits counter\n"
+		"# HELP syncsh_admission_waits Recipes held back by SYNCSH_ADMIT for a millisecond or more.\n"
+		"syncsh_admission_waits_total %llu\n"
+		"# TYPE syncsh_admission_wait_seconds counter\n"
+		"# UNIT syncsh_admission_wait_seconds seconds\n"
+		"# HELP syncsh_admission_wait_seconds Time recipes spent waiting for memory under SYNCSH_ADMIT.\n"
+		"syncsh_admission_wait_seconds_total %.6f\n"
+		"# TYPE syncsh_admission_reserved_max_bytes gauge\n"
+		"# UNIT syncsh_admission_reserved_max_bytes bytes\n"
+		"# HELP syncsh_admission_reserved_max_bytes Largest memory reservation of any recipe under SYNCSH_ADMIT.\n"
+		"syncsh_admission_reserved_max_bytes %lld\n",
+		(unsigned long long)m.admitwaits, m.awsum / 1e6, (long long)m.ammax);
+    fprintf(fp, "# TYPE syncsh_cgroup_memory_peak_bytes gauge\n"
+	    "# UNIT syncsh_cgroup_memory_peak_bytes bytes\n"
+	    "# HELP syncsh_cgroup_memory_peak_bytes Largest memory.peak of any recipe cgroup.\n"
+	    "syncsh_cgroup_memory_peak_bytes %lld\n"
+	    "# TYPE syncsh_cgroup_cpu_seconds counter\n"
+	    "# UNIT syncsh_cgroup_cpu_seconds seconds\n"
+	    "# HELP syncsh_cgroup_cpu_seconds CPU time used by recipe cgroups.\n"
+	    "syncsh_cgroup_cpu_seconds_total %.6f\n"
+	    "# TYPE syncsh_cgroup_io_bytes counter\n"
+	    "# UNIT syncsh_cgroup_io_bytes bytes\n"
+	    "# HELP syncsh_cgroup_io_bytes Block I/O by recipe cgroups.\n"
+	    "syncsh_cgroup_io_bytes_total{direction=\"read\"} %lld\n"
+	    "syncsh_cgroup_io_bytes_total{direction=\"write\"} %lld\n",
+	    m.cgmax, m.cgcpu / 1e6, m.cgread, m.cgwrite);
+    fprintf(fp, "# TYPE syncsh_build_wall_seconds gauge\n"
+	    "# UNIT syncsh_build_wall_seconds seconds\n"
+	    "# HELP syncsh_build_wall_seconds First recipe start to last recipe end.\n"
+	    "syncsh_build_wall_seconds %.6f\n", (m.last - m.first) / 1e6);
+    fprintf(fp, "# EOF\n");
+
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp))
+	syserr(2, tmp);
+    if (rename(tmp, argv[2]) == -1)
+	syserr(2, argv[2]);
+
+    return 0;
 }
 
-static void *
-acquire_semaphore(int fd, pid_t pid, uint16_t off)
+/*
+ * "syncsh report [-b build] <statsdir>": an offline look at a build
+ * from its stats records. The records are streamed twice (once to
+ * find the time span, once to aggregate) into fixed-size tables so
+ * memory use doesn't grow with the size of the build.
+ */
+#define REPORT_BINS	4096	/* time resolution of the profile */
+#define REPORT_COLS	60	/* width of the printed profile */
+#define REPORT_TOP	10
+
+struct topn {
+    int64_t value[REPORT_TOP];
+    char what[REPORT_TOP][72];
+    int n;
+};
+
+struct report {
+    int64_t first, last, width;
+    uint64_t recipes, failures;
+    int64_t work, blocked, held;
+    struct loghist hold;	/* output lock hold times */
+    double busy[REPORT_BINS];	/* recipe-usec running in each bin */
+    struct {			/* latest-ending recipe in each bin */
+	int64_t t0, t1;
+	char what[72];
+    } ends[REPORT_BINS];
+    struct topn slowest, loudest, commands;
+};
+
+static void
+topn_add(struct topn *t, int64_t value, const char *what)
 {
-    static struct flock fl;
+    int i;
 
-    fl.l_type = F_WRLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_pid = pid;
-    fl.l_start = off;		/* lock just one byte */
-    fl.l_len = 1;
-    if (fcntl(fd, F_SETLKW, &fl) != -1) {
-	if (getenv(PFX "DEBUG"))
-	    fprintf(stderr, "%s: locked byte %d.%u for '%s'\n", prog, fd, off, recipe);
-	return &fl;
+    if (t->n == REPORT_TOP && value <= t->value[REPORT_TOP - 1])
+	return;
+    if (t->n < REPORT_TOP)
+	t->n++;
+    for (i = t->n - 1; i > 0 && t->value[i - 1] < value; i--) {
+	t->value[i] = t->value[i - 1];
+	memcpy(t->what[i], t->what[i - 1], sizeof(t->what[i]));
     }
-    perror("fcntl()");
-    return NULL;
+    t->value[i] = value;
+    snprintf(t->what[i], sizeof(t->what[i]), "%s", what ? what : "?");
 }
 
 static void
-release_semaphore(void *sem, int fd)
+report_span(struct rec *r, void *arg)
 {
-    struct flock *flp = (struct flock *)sem;
+    struct report *rp = (struct report *)arg;
 
-    flp->l_type = F_UNLCK;
-    if (fcntl(fd, F_SETLKW, flp) == -1)
-	perror("fcntl()");
+    if (r->type)
+	return;
+    if (!rp->first || r->t0 < rp->first)
+	rp->first = r->t0;
+    if (r->t1 > rp->last)
+	rp->last = r->t1;
 }
 
-int
-main(int argc, char *argv[])
+static int
+report_bin(const struct report *rp, int64_t t)
 {
-    int status = 0;
-    int teefd = -1;
-    int syncfd = -1;
-    pid_t child;
-    FILE *tempout = NULL;
-    FILE *temperr = NULL;
-    char *sh;
-    char *tee;
-    char *syncfile;
-    char *verbose = NULL;
-    char *serialize;
-    char *shargv[4];
-    void *sem = NULL;
-    pid_t thispid;
+    int64_t b = (t - rp->first) / rp->width;
 
-    prog = basename(argv[0]);
+    return b < 0 ? 0 : b >= REPORT_BINS ? REPORT_BINS - 1 : (int)b;
+}
 
-    if (argc <= 1 || !strcmp(argv[1], "-h") || strstr(argv[1], "help")) {
-	usage();
+static void
+report_add(struct rec *r, void *arg)
+{
+    struct report *rp = (struct report *)arg;
+    int64_t lo, hi;
+    int b;
+
+    if (r->type) {
+	if (!strcmp(r->type, "cmd"))
+	    topn_add(&rp->commands, r->ut + r->kt, r->cmd);
+	return;
+    }
+    rp->recipes++;
+    if (r->exitcode)
+	rp->failures++;
+    rp->work += r->t1 - r->t0;
+    rp->blocked += r->lw + (r->sw > 0 ? r->sw : 0) + (r->cw > 0 ? r->cw : 0);
+    if (r->lh > 0) {
+	rp->held += r->lh;
+	lh_add(&rp->hold, r->lh);
     }
+    topn_add(&rp->slowest, r->t1 - r->t0, r->recipe);
+    topn_add(&rp->loudest, r->ob + r->eb, r->recipe);
 
-    thispid = getpid();
+    for (b = report_bin(rp, r->t0); b <= report_bin(rp, r->t1); b++) {
+	lo = rp->first + b * rp->width;
+	hi = lo + rp->width;
+	if (lo < r->t0)
+	    lo = r->t0;
+	if (hi > r->t1)
+	    hi = r->t1;
+	if (hi > lo)
+	    rp->busy[b] += hi - lo;
+    }
 
-    recipe = argv[2];
+    b = report_bin(rp, r->t1);
+    if (r->t1 > rp->ends[b].t1) {
+	rp->ends[b].t0 = r->t0;
+	rp->ends[b].t1 = r->t1;
+	snprintf(rp->ends[b].what, sizeof(rp->ends[b].what), "%s",
+		 r->recipe ? r->recipe : "?");
+    }
+}
 
-    verbose = getenv(PFX "VERBOSE");
+static void
+topn_print(const struct topn *t, const char *title, int seconds)
+{
+    int i;
 
-    if (!(sh = getenv(PFX "SHELL")))
-	sh = "/bin/sh";
+    if (!t->n)
+	return;
+    printf("\n%s:\n", title);
+    for (i = 0; i < t->n; i++) {
+	if (seconds)
+	    printf("  %9.3fs  %s\n", t->value[i] / 1e6, t->what[i]);
+	else
+	    printf("  %9lldB  %s\n", (long long)t->value[i], t->what[i]);
+    }
+}
 
-    /*
-     * Here it looks like the shell is not being used to run a recipe.y
-     * E.g. the makefile may contain a literal "$(SHELL) foobar.sh ..."
-     * within a recipe or in some function such as $(shell foobar.sh).
-     * Since we're not running a recipe we don't need to worry about
-     * synchronizing with other recipes.
-     * Special case of the above: if MAKELEVEL is not present at all,
-     * that means we're (a) in a top-level (non-recursive) make process
-     * and (b) we're not running a recipe, since MAKELEVEL is incremented
-     * and exported for each recipe.
-     */
-    if (argc != 3 || argv[1][0] != '-' || !strchr(argv[1], 'c')
-	|| argv[2][0] == '-' || !getenv("MAKELEVEL")) {
-	argv[0] = sh;
-	if (verbose) {
-	    fflush(stderr);
-	    vb(fileno(stderr), verbose, argv);
+/*
+ * Estimate the critical path by walking back from the last recipe
+ * to finish, each time to the latest recipe which finished before
+ * the current one started - i.e. the one it was most likely waiting
+ * for. Resolution is limited to a bin, hence "estimated".
+ */
+static int64_t
+report_path(struct report *rp, int print)
+{
+    int chain[REPORT_BINS];
+    int64_t len = 0;
+    int b, cur, n = 0, i;
+
+    for (cur = REPORT_BINS - 1; cur >= 0 && !rp->ends[cur].t1; cur--)
+	continue;
+    while (cur >= 0 && n < REPORT_BINS) {
+	chain[n++] = cur;
+	len += rp->ends[cur].t1 - rp->ends[cur].t0;
+	for (b = report_bin(rp, rp->ends[cur].t0); b >= 0; b--)
+	    if (rp->ends[b].t1 && rp->ends[b].t1 <= rp->ends[cur].t0)
+		break;
+	cur = b;
+    }
+
+    if (print) {
+	printf("\nEstimated critical path (%d recipes, %.3fs):\n", n, len / 1e6);
+	for (i = n - 1; i >= 0; i--) {
+	    if (n > 40 && i == n - 20)
+		printf("  ... %d more ...\n", n - 40);
+	    if (n > 40 && i < n - 20 && i >= 20)
+		continue;
+	    printf("  %9.3fs  %s\n",
+		   (rp->ends[chain[i]].t1 - rp->ends[chain[i]].t0) / 1e6,
+		   rp->ends[chain[i]].what);
 	}
-	execvp(argv[0], argv);
-	syserr(2, argv[0]);
     }
 
-    shargv[0] = sh;
-    shargv[1] = argv[1];
-    shargv[2] = recipe;
-    shargv[3] = NULL;
+    return len;
+}
 
-    if ((syncfile = getenv(PFX "SYNCFILE"))) {
-	if (!is_absolute(syncfile)) {
-	    fprintf(stderr, "%s: Error: '%s' must be an absolute path\n",
-		    prog, syncfile);
-	    return 2;
-	}
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
 
-	/*
-	 * Note that we NEVER write to a syncfile but must open
-	 * it for write in order for fcntl() to acquire the lock.
-	 */
-	if ((syncfd = open(syncfile, O_WRONLY | O_APPEND) == -1)) {
-	    syserr(0, syncfile);
-	} else if (getenv(PFX "DEBUG")) {
-	    fprintf(stderr, "%s: syncing with %d=%s\n", prog, syncfd, syncfile);
-	}
-    } else {
-	if (STREAM_OK(stdout)) {
-	    syncfd = fileno(stdout);
-	} else if (STREAM_OK(stderr)) {
-	    syncfd = fileno(stderr);
-	} else {
-	    syserr(0, "stdout");
+    return x < y ? -1 : x > y;
+}
+
+static int
+report_main(int argc, char *argv[])
+{
+    static struct report rp;
+    static double sorted[REPORT_BINS];
+    double wall, peak = 0, col, colmax = 0, cols[REPORT_COLS];
+    int64_t path;
+    char *build = NULL;
+    int b, c, j95 = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-b")) {
+	build = argv[2];
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc != 2)
+	usage();
+    if (foreach_record(argv[1], build, report_span, &rp))
+	return 2;
+    if (!rp.last) {
+	printf("No records found.\n");
+	return 0;
+    }
+    rp.width = (rp.last - rp.first) / REPORT_BINS + 1;
+    foreach_record(argv[1], build, report_add, &rp);
+
+    wall = (rp.last - rp.first) / 1e6;
+    printf("%llu recipes (%llu failed) in %.3fs; %.3fs of recipe time\n",
+	   (unsigned long long)rp.recipes, (unsigned long long)rp.failures,
+	   wall, rp.work / 1e6);
+    if (rp.work)
+	printf("Blocked on syncsh locks: %.3fs (%.1f%%), running: %.3fs\n",
+	       rp.blocked / 1e6, 100.0 * rp.blocked / rp.work,
+	       (rp.work - rp.blocked) / 1e6);
+    if (rp.hold.count)
+	printf("Output lock held: %.3fs in all, per recipe p50 %.3fms, p99 %.3fms\n",
+	       rp.held / 1e6, lh_quantile(&rp.hold, 0.5) / 1e3,
+	       lh_quantile(&rp.hold, 0.99) / 1e3);
+
+    /* Parallelism over time, averaged over each printed column. */
+    for (c = 0; c < REPORT_COLS; c++)
+	cols[c] = 0;
+    for (b = 0; b < REPORT_BINS; b++) {
+	sorted[b] = rp.busy[b] / rp.width;
+	if (sorted[b] > peak)
+	    peak = sorted[b];
+	cols[b * REPORT_COLS / REPORT_BINS] += sorted[b];
+    }
+    for (c = 0; c < REPORT_COLS; c++) {
+	cols[c] /= REPORT_BINS / REPORT_COLS;
+	if (cols[c] > colmax)
+	    colmax = cols[c];
+    }
+    printf("\nParallelism over time (peak %.1f, average %.1f):\n",
+	   peak, wall > 0 ? rp.work / 1e6 / wall : 0);
+    for (b = 8; b > 0; b--) {
+	printf("  %5.1f |", colmax * b / 8);
+	for (c = 0; c < REPORT_COLS; c++) {
+	    col = cols[c] * 8 / (colmax ? colmax : 1);
+	    putchar(col >= b ? '#' : col >= b - 0.5 ? '.' : ' ');
 	}
+	putchar('\n');
     }
+    printf("        +");
+    for (c = 0; c < REPORT_COLS; c++)
+	putchar('-');
+    printf("\n         0%*s%.1fs\n", REPORT_COLS - 6, "", wall);
 
-    if (verbose)
-	vb(fileno(temperr), verbose, shargv + 2);
+    topn_print(&rp.slowest, "Slowest recipes", 1);
+    topn_print(&rp.loudest, "Most output", 0);
+    topn_print(&rp.commands, "Most CPU by command", 1);
+    path = report_path(&rp, 1);
 
     /*
-     * We could be asked to serialize a certain type of recipe
-     * in which case the semaphore is acquired *before* the fork
-     * and we don't need to bother about tempfiles.
+     * The level of parallelism not exceeded 95% of the time, and
+     * Brent's bound on what more jobs could have bought.
      */
-    if ((serialize = getenv(PFX "SERIALIZE"))) {
-	regex_t re;
+    qsort(sorted, REPORT_BINS, sizeof(sorted[0]), cmp_double);
+    j95 = (int)(sorted[REPORT_BINS * 95 / 100] + 0.999);
+    printf("\nAt most %d jobs were running 95%% of the time; -j%d would have been enough.\n",
+	   j95 ? j95 : 1, j95 ? j95 : 1);
+    if (path > 0)
+	printf("The critical path bounds the build at %.3fs; with -jN expect about %.3fs/N + %.3fs.\n",
+	       path / 1e6, rp.work / 1e6, path / 1e6);
+
+    return 0;
+}
 
-	if (regcomp(&re, serialize, REG_EXTENDED)) {
-	    /* TODO - generate a better error message */
-	    fprintf(stderr, "%s: Error: bad regular expression '%s'\n", prog,
-		    serialize);
-	} else {
-	    regmatch_t pm[1];
 
-	    if (!regexec(&re, recipe, 1, pm, 0)) {
-		uint16_t hash;
+/*
+ * Sharded tee logs (SYNCSH_TEESHARDS). "log merge" reads the entry
+ * headers of every shard, sorts them by sequence number and copies
+ * out each entry's output in that order; "log query" walks the same
+ * order, listing the entries whose recipe matches -r, or with -g
+ * printing the matching lines of their output prefixed by the
+ * entry's sequence number.
+ */
+struct shard {
+    FILE *fp;
+    unsigned long long seq, len;
+    long long t;
+    long pid;
+    char head[PIPE_BUF];
+    char *recipe;
+};
+
+/* An entry of the log, wherever it is. */
+struct entry {
+    unsigned long long seq, len;
+    long long t;
+    long pid;
+    char *recipe;
+    FILE *fp;
+    off_t off;			/* of its output */
+};
+
+/* Read the shard's next entry header; 0 at the end. */
+static int
+shard_next(struct shard *sh)
+{
+    char *tok, *val, *save = NULL;
 
-		hash = str_hash(serialize, strlen(serialize));
-		sem = acquire_semaphore(syncfd, thispid, hash);
+    if (!fgets(sh->head, sizeof(sh->head), sh->fp))
+	return 0;
+    sh->head[strcspn(sh->head, "\n")] = '\0';
+    if (strncmp(sh->head, "@@syncsh\t", 9)) {
+	fprintf(stderr, "%s: Error: bad log entry '%.40s'\n", prog, sh->head);
+	return 0;
+    }
+    sh->recipe = "";
+    for (tok = strtok_r(sh->head + 9, "\t", &save); tok;
+	 tok = strtok_r(NULL, "\t", &save)) {
+	if (!(val = strchr(tok, '=')))
+	    continue;
+	*val++ = '\0';
+	if (!strcmp(tok, "seq"))
+	    sh->seq = strtoull(val, NULL, 10);
+	else if (!strcmp(tok, "t"))
+	    sh->t = atoll(val);
+	else if (!strcmp(tok, "pid"))
+	    sh->pid = atol(val);
+	else if (!strcmp(tok, "len"))
+	    sh->len = strtoull(val, NULL, 10);
+	else if (!strcmp(tok, "r"))
+	    sh->recipe = val;
+    }
+
+    return 1;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Entries are appended to a shard in the order they win its lock,
+ * which needn't be their sequence order, so the headers of every
+ * shard are read first and the entries sorted.
+ */
+static int
+log_main(int argc, char *argv[])
+{
+    regex_t rre, gre;
+    int merge, rflag = 0, gflag = 0, i;
+    struct entry *ents = NULL, *e;
+    size_t nents = 0, maxents = 0, k, n;
+    struct shard sh;
+    FILE **shards, *tmp;
+    int nshards = 0;
+    char pattern[PATH_MAX + 8], buffer[65536], *line = NULL;
+    size_t linesize = 0;
+    unsigned long long left;
+    glob_t g;
+
+    if (argc < 3)
+	usage();
+    merge = !strcmp(argv[1], "merge");
+    if (!merge && strcmp(argv[1], "query"))
+	usage();
+    argc--;
+    argv++;
+    while (!merge && argc > 3 && argv[1][0] == '-') {
+	if (!strcmp(argv[1], "-r") && !regcomp(&rre, argv[2], REG_EXTENDED | REG_NOSUB))
+	    rflag = 1;
+	else if (!strcmp(argv[1], "-g") && !regcomp(&gre, argv[2], REG_EXTENDED | REG_NOSUB))
+	    gflag = 1;
+	else
+	    usage();
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc != 2)
+	usage();
+
+    snprintf(pattern, sizeof(pattern), "%s.[0-9]*", argv[1]);
+    if (glob(pattern, 0, NULL, &g) || !g.gl_pathc) {
+	fprintf(stderr, "%s: Error: no shards of '%s'\n", prog, argv[1]);
+	return 2;
+    }
+    if (!(shards = calloc(g.gl_pathc, sizeof(*shards))))
+	syserr(2, "calloc");
+    for (i = 0; i < (int)g.gl_pathc; i++) {
+	if (!(sh.fp = fopen(g.gl_pathv[i], "r"))) {
+	    syserr(0, g.gl_pathv[i]);
+	    continue;
+	}
+	shards[nshards++] = sh.fp;
+	while (shard_next(&sh)) {
+	    if (nents == maxents) {
+		maxents = maxents ? 2 * maxents : 256;
+		if (!(ents = realloc(ents, maxents * sizeof(*ents))))
+		    syserr(2, "realloc");
 	    }
-	    regfree(&re);
+	    e = &ents[nents++];
+	    e->seq = sh.seq;
+	    e->len = sh.len;
+	    e->t = sh.t;
+	    e->pid = sh.pid;
+	    e->fp = sh.fp;
+	    e->off = ftello(sh.fp);
+	    if (!(e->recipe = strdup(sh.recipe)))
+		syserr(2, "strdup");
+	    if (fseeko(sh.fp, sh.len, SEEK_CUR))
+		break;
 	}
     }
+    globfree(&g);
+    qsort(ents, nents, sizeof(*ents), entry_cmp);
 
-    /* Otherwise, prepare the tempfiles. */
-    if (!sem) {
-	if (!(tempout = tmpfile()) || !(temperr = tmpfile())) {
+    for (k = 0; k < nents; k++) {
+	e = &ents[k];
+	if (rflag && regexec(&rre, e->recipe, 0, NULL, 0))
+	    continue;
+	tmp = NULL;
+
+	if (!merge && !gflag)
+	    printf("%llu\t%lld\t%ld\t%llu\t%s\n", e->seq, e->t, e->pid,
+		   e->len, e->recipe);
+	if (gflag && !(tmp = tmpfile()))
 	    syserr(2, "tmpfile");
+	if ((merge || tmp) && fseeko(e->fp, e->off, SEEK_SET))
+	    continue;
+	for (left = e->len; (merge || tmp) && left; left -= n) {
+	    n = left < sizeof(buffer) ? left : sizeof(buffer);
+	    if ((n = fread(buffer, 1, n, e->fp)) == 0)
+		break;
+	    if (merge)
+		fwrite(buffer, 1, n, stdout);
+	    else
+		fwrite(buffer, 1, n, tmp);
+	}
+	if (tmp) {
+	    rewind(tmp);
+	    while (getline(&line, &linesize, tmp) > 0)
+		if (!regexec(&gre, line, 0, NULL, 0))
+		    printf("%llu:%s", e->seq, line);
+	    fclose(tmp);
 	}
     }
+    free(line);
+    for (k = 0; k < nents; k++)
+	free(ents[k].recipe);
+    free(ents);
+    for (i = 0; i < nshards; i++)
+	fclose(shards[i]);
+    free(shards);
+
+    return ferror(stdout) ? 2 : 0;
+}
 
-    /* GNU make uses vfork so we do too */
-    child = vfork();
-    if (child == (pid_t) 0) {
-	if (tempout && (close(fileno(stdout)) == -1
-			|| (dup2(fileno(tempout), fileno(stdout)) == -1)))
-	    syserr(2, "dup2(stdout)");
 
-	if (temperr && (close(fileno(stderr)) == -1
-			|| (dup2(fileno(temperr), fileno(stderr)) == -1)))
-	    syserr(2, "dup2(stderr)");
+/*
+ * The event broker. Publishers connect to <socket> (see SYNCSH_EVENTS)
+ * and send an event per message; subscribers connect to <socket>.sub
+ * and are sent every event from then on, back to back. Each
+ * subscriber has a queue of its own and one too slow to keep up
+ * misses events, getting a LOST event with the count once there's
+ * room again, so nothing ever waits on a subscriber.
+ */
+#define MAX_PUBS	1024
+#define MAX_SUBS	64
+#define SUB_QUEUE	(1 << 20)
+
+struct sub {
+    int fd;
+    char *q;			/* ring of SUB_QUEUE bytes */
+    size_t head, len;
+    uint64_t lost;
+};
+
+struct lost_event {
+    struct syncsh_event h;
+    uint64_t count;
+};
+
+static volatile sig_atomic_t broker_stop;
+
+static void
+broker_signal(int sig)
+{
+    (void)sig;
+    broker_stop = 1;
+}
 
-	execvp(shargv[0], shargv);
-	perror(shargv[0]);
-	exit(EXIT_FAILURE);
-    } else if (child == (pid_t) - 1) {
-	syserr(2, "fork");
+static int
+sock_addr(struct sockaddr_un *sa, const char *path, const char *ext)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (!is_absolute(path)
+	|| snprintf(sa->sun_path, sizeof(sa->sun_path), "%s%s", path, ext)
+	>= (int)sizeof(sa->sun_path)) {
+	fprintf(stderr, "%s: Error: bad socket path '%s'\n", prog, path);
+	return -1;
     }
 
-    waitpid(child, &status, 0);
+    return 0;
+}
 
-    if (tempout && lseek(fileno(tempout), 0, SEEK_SET) == -1)
-	syserr(2, "lseek(stdout)");
+static int
+sub_put(struct sub *sb, const void *p, size_t n)
+{
+    size_t tail, k;
 
-    if (temperr && lseek(fileno(temperr), 0, SEEK_SET) == -1)
-	syserr(2, "lseek(stderr)");
+    if (SUB_QUEUE - sb->len < n)
+	return -1;
+    tail = (sb->head + sb->len) % SUB_QUEUE;
+    k = n < SUB_QUEUE - tail ? n : SUB_QUEUE - tail;
+    memcpy(sb->q + tail, p, k);
+    memcpy(sb->q, (const char *)p + k, n - k);
+    sb->len += n;
 
-    if ((tee = getenv(PFX "TEE"))) {
-	if (!is_absolute(tee)) {
-	    fprintf(stderr, "%s: Error: '%s' not an absolute path\n",
-		    prog, tee);
-	    return 2;
+    return 0;
+}
+
+static void
+sub_event(struct sub *sb, const struct syncsh_event *ev)
+{
+    struct lost_event lost;
+
+    if (sb->lost) {
+	memset(&lost, 0, sizeof(lost));
+	lost.h.len = sizeof(lost);
+	lost.h.type = SYNCSH_EV_LOST;
+	lost.h.pid = getpid();
+	lost.h.t = syncsh_now_us();
+	lost.count = sb->lost;
+	if (sub_put(sb, &lost, sizeof(lost))) {
+	    sb->lost++;
+	    return;
 	}
-	teefd = open(tee, O_APPEND | O_WRONLY | O_CREAT, 0644);
+	sb->lost = 0;
     }
+    if (sub_put(sb, ev, ev->len))
+	sb->lost++;
+}
+
+/* Send what the subscriber will take; -1 if it has gone. */
+static int
+sub_flush(struct sub *sb)
+{
+    size_t k;
+    ssize_t n;
+
+    while (sb->len) {
+	k = sb->len < SUB_QUEUE - sb->head ? sb->len : SUB_QUEUE - sb->head;
+	if ((n = write(sb->fd, sb->q + sb->head, k)) <= 0)
+	    return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	sb->head = (sb->head + n) % SUB_QUEUE;
+	sb->len -= n;
+    }
+
+    return 0;
+}
+
+static int
+broker_main(int argc, char *argv[])
+{
+    static struct sub subs[MAX_SUBS];
+    static int pubs[MAX_PUBS];
+    static struct pollfd pfd[2 + MAX_PUBS + MAX_SUBS];
+    static char buf[SYNCSH_EV_MAX];
+    struct sockaddr_un pa, sa;
+    struct sigaction act;
+    int publis, sublis, fd, npubs = 0, nsubs = 0, gone, i, j, k;
+    struct pollfd *sp;
+    ssize_t n;
+    char c;
+
+    if (argc != 2)
+	usage();
+    if (sock_addr(&pa, argv[1], "") || sock_addr(&sa, argv[1], ".sub"))
+	return 2;
+    unlink(pa.sun_path);
+    unlink(sa.sun_path);
+    if ((publis = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1
+	|| bind(publis, (struct sockaddr *)&pa, sizeof(pa)) == -1
+	|| listen(publis, 128) == -1)
+	syserr(2, pa.sun_path);
+    if ((sublis = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	|| bind(sublis, (struct sockaddr *)&sa, sizeof(sa)) == -1
+	|| listen(sublis, 16) == -1)
+	syserr(2, sa.sun_path);
+    fcntl(publis, F_SETFL, O_NONBLOCK);
 
-    if (!sem && (sem = acquire_semaphore(syncfd, thispid, 0))) {
-	char *headline;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = broker_signal;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!broker_stop) {
+	pfd[0].fd = publis;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sublis;
+	pfd[1].events = POLLIN;
+	for (i = 0; i < npubs; i++) {
+	    pfd[2 + i].fd = pubs[i];
+	    pfd[2 + i].events = POLLIN;
+	}
+	sp = pfd + 2 + npubs;
+	for (i = 0; i < nsubs; i++) {
+	    sp[i].fd = subs[i].fd;
+	    sp[i].events = POLLIN | (subs[i].len ? POLLOUT : 0);
+	}
+	if (poll(pfd, 2 + npubs + nsubs, -1) == -1)
+	    continue;
 
 	/*
-	 * We've entered the "critical section" during which a lock is held.
-	 * We want to keep it as short as possible.
+	 * A bounded batch from each publisher, so none can starve the
+	 * others or the subscribers under a flood.
 	 */
+	for (i = npubs - 1; i >= 0; i--) {
+	    if (!pfd[2 + i].revents)
+		continue;
+	    for (k = 0; k < 64; k++) {
+		if ((n = recv(pubs[i], buf, sizeof(buf), MSG_DONTWAIT)) == -1
+		    && (errno == EAGAIN || errno == EINTR))
+		    break;
+		if (n <= 0) {
+		    close(pubs[i]);
+		    pubs[i] = pubs[--npubs];
+		    break;
+		}
+		if (n < (ssize_t) sizeof(struct syncsh_event)
+		    || ((struct syncsh_event *)buf)->len != n)
+		    continue;
+		for (j = 0; j < nsubs; j++)
+		    sub_event(&subs[j], (struct syncsh_event *)buf);
+	    }
+	}
+
+	/* Last first, so a dropped subscriber's place is already done. */
+	for (i = nsubs - 1; i >= 0; i--) {
+	    gone = 0;
+	    if (sp[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+		n = read(subs[i].fd, &c, 1);
+		gone = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+	    }
+	    if (!gone && subs[i].len)
+		gone = sub_flush(&subs[i]);
+	    if (gone) {
+		close(subs[i].fd);
+		free(subs[i].q);
+		subs[i] = subs[--nsubs];
+	    }
+	}
 
-	if ((headline = getenv(PFX "HEADLINE"))) {
-	    write(fileno(stdout), headline, strlen(headline));
-	    write(fileno(stdout), "\n", 1);
+	while ((pfd[0].revents & POLLIN) && (fd = accept(publis, NULL, NULL)) != -1) {
+	    if (npubs == MAX_PUBS)
+		close(fd);
+	    else
+		pubs[npubs++] = fd;
 	}
+	if ((pfd[1].revents & POLLIN) && (fd = accept(sublis, NULL, NULL)) != -1) {
+	    fcntl(fd, F_SETFL, O_NONBLOCK);
+	    if (nsubs == MAX_SUBS || !(subs[nsubs].q = malloc(SUB_QUEUE))) {
+		close(fd);
+	    } else {
+		subs[nsubs].fd = fd;
+		subs[nsubs].head = subs[nsubs].len = 0;
+		subs[nsubs].lost = 0;
+		nsubs++;
+	    }
+	}
+    }
+    unlink(pa.sun_path);
+    unlink(sa.sun_path);
+
+    return 0;
+}
+
 
-	if (teefd > 0) {
-	    lseek(teefd, 0, SEEK_END);
-	    if (headline) {
-		write(teefd, headline, strlen(headline));
-		write(teefd, "\n", 1);
+static int
+events_main(int argc, char *argv[])
+{
+    static const char *names[] = { "?", "start", "output", "lock", "exit", "lost" };
+    static char buf[2 * SYNCSH_EV_MAX];
+    struct syncsh_event ev;
+    struct syncsh_ev_lock lk;
+    struct syncsh_ev_exit ex;
+    struct sockaddr_un sa;
+    size_t have = 0, off;
+    uint64_t count;
+    ssize_t n;
+    int fd;
+
+    if (argc != 2)
+	usage();
+    if (sock_addr(&sa, argv[1], ".sub"))
+	return 2;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	|| connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+	syserr(2, sa.sun_path);
+
+    /* One line per event: time, pid, job, seq, type and the details. */
+    while ((n = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+	have += n;
+	for (off = 0; have - off >= sizeof(ev); off += ev.len) {
+	    memcpy(&ev, buf + off, sizeof(ev));
+	    if (ev.len < sizeof(ev) || ev.len > SYNCSH_EV_MAX) {
+		fprintf(stderr, "%s: Error: bad event stream\n", prog);
+		return 2;
+	    }
+	    if (have - off < ev.len)
+		break;
+	    if (ev.len - sizeof(ev) < (ev.type == SYNCSH_EV_LOCK ? sizeof(lk)
+				       : ev.type == SYNCSH_EV_EXIT ? sizeof(ex)
+				       : ev.type == SYNCSH_EV_LOST ? sizeof(count) : 0)) {
+		fprintf(stderr, "%s: Error: short %s event\n", prog, names[ev.type]);
+		return 2;
 	    }
+	    printf("%lld\t%u\t%u\t%u\t%s", (long long)ev.t, ev.pid, ev.job, ev.seq,
+		   names[ev.type <= SYNCSH_EV_LOST ? ev.type : 0]);
+	    switch (ev.type) {
+	    case SYNCSH_EV_START:
+		printf("\t%.*s", (int)(ev.len - sizeof(ev)), buf + off + sizeof(ev));
+		break;
+	    case SYNCSH_EV_OUTPUT:
+		printf("\t%d\t%u", ev.stream, (unsigned)(ev.len - sizeof(ev)));
+		break;
+	    case SYNCSH_EV_LOCK:
+		memcpy(&lk, buf + off + sizeof(ev), sizeof(lk));
+		printf("\t%lld\t%lld", (long long)lk.wait, (long long)lk.hold);
+		break;
+	    case SYNCSH_EV_EXIT:
+		memcpy(&ex, buf + off + sizeof(ev), sizeof(ex));
+		printf("\t%d\t%lld\t%x", ex.status, (long long)ex.wall, ex.flags);
+		break;
+	    case SYNCSH_EV_LOST:
+		memcpy(&count, buf + off + sizeof(ev), sizeof(count));
+		printf("\t%llu", (unsigned long long)count);
+		break;
+	    }
+	    putchar('\n');
 	}
+	memmove(buf, buf + off, have - off);
+	have -= off;
+	fflush(stdout);
+    }
+
+    return 0;
+}
+
+
+/*
+ * The lock broker, for builds spread over machines sharing a console
+ * log (see SYNCSH_LOCKD). A client sends "L <len>\n" and its <len>
+ * byte log entry, and is granted the output lock with a "G" in the
+ * order the requests came in, its entry having been appended to the
+ * log just before. Closing the connection releases the lock, or if
+ * it wasn't granted yet gives up its turn. An entry over MAX_ENTRY
+ * gets the client cut off rather than the memory.
+ */
+#define MAX_CLIENTS	1024
+#define MAX_ENTRY	(256 << 20)
+
+struct client {
+    int fd;
+    unsigned long long ticket;	/* 0 until the request is in */
+    char head[64];
+    size_t hlen;
+    char *data;
+    size_t len, got;
+};
+
+static int
+lockd_listen(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sa;
+    char host[256], *port;
+    int fd = -1, one = 1;
 
-	if (tempout) {
-	    pump_from_tmp_fd(fileno(tempout), fileno(stdout));
-	    if (teefd > 0)
-		pump_from_tmp_fd(fileno(tempout), teefd);
-	    fclose(tempout);
+    if (is_absolute(addr)) {
+	if (sock_addr(&sa, addr, ""))
+	    return -1;
+	unlink(sa.sun_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	    || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+	    syserr(2, addr);
+    } else {
+	snprintf(host, sizeof(host), "%s", addr);
+	if (!(port = strrchr(host, ':'))) {
+	    fprintf(stderr, "%s: Error: bad address '%s'\n", prog, addr);
+	    return -1;
+	}
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(*host ? host : NULL, port, &hints, &res)) {
+	    fprintf(stderr, "%s: Error: bad address '%s'\n", prog, addr);
+	    return -1;
 	}
-	if (temperr && temperr != tempout) {
-	    pump_from_tmp_fd(fileno(temperr), fileno(stderr));
-	    if (teefd > 0)
-		pump_from_tmp_fd(fileno(temperr), teefd);
-	    fclose(temperr);
+	for (ai = res; ai; ai = ai->ai_next) {
+	    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+		continue;
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	    if (bind(fd, ai->ai_addr, ai->ai_addrlen) != -1)
+		break;
+	    close(fd);
+	    fd = -1;
 	}
+	freeaddrinfo(res);
+	if (fd == -1)
+	    syserr(2, addr);
     }
+    if (listen(fd, 128) == -1)
+	syserr(2, addr);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
 
-    /* Exit the critical section */
-    if (sem)
-	release_semaphore(sem, syncfd);
+/* Take what the client has sent; -1 if it has gone or is confused. */
+static int
+client_read(struct client *cl, unsigned long long *tickets)
+{
+    ssize_t n;
 
-    close(syncfd);
+    while (!cl->ticket) {
+	if ((n = read(cl->fd, cl->head + cl->hlen, 1)) <= 0)
+	    return n < 0 && errno == EAGAIN ? 0 : -1;
+	if (cl->head[cl->hlen] != '\n') {
+	    if (++cl->hlen == sizeof(cl->head))
+		return -1;
+	    continue;
+	}
+	cl->head[cl->hlen] = '\0';
+	if (sscanf(cl->head, "L %zu", &cl->len) != 1)
+	    return -1;
+	if (cl->len > MAX_ENTRY) {
+	    fprintf(stderr, "%s: Error: rejected a %zu byte log entry\n",
+		    prog, cl->len);
+	    return -1;
+	}
+	if (!(cl->data = malloc(cl->len + 1)))
+	    return -1;
+	cl->ticket = ++*tickets;
+    }
+    while (cl->got < cl->len) {
+	if ((n = read(cl->fd, cl->data + cl->got, cl->len - cl->got)) <= 0)
+	    return n < 0 && errno == EAGAIN ? 0 : -1;
+	cl->got += n;
+    }
+    /* Anything more means it's gone, or is talking out of turn. */
+    n = read(cl->fd, cl->head, 1);
+
+    return n < 0 && errno == EAGAIN ? 0 : -1;
+}
+
+static int
+lockd_main(int argc, char *argv[])
+{
+    static struct client cls[MAX_CLIENTS];
+    static struct pollfd pfd[1 + MAX_CLIENTS];
+    unsigned long long tickets = 0;
+    struct sigaction act;
+    int lis, logfd = 1, ncls = 0, holder = -1, fd, one = 1, i, next;
+    ssize_t n;
+    size_t off;
+
+    if (argc != 2 && argc != 3)
+	usage();
+    if ((lis = lockd_listen(argv[1])) == -1)
+	return 2;
+    if (argc == 3
+	&& (logfd = open(argv[2], O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1)
+	syserr(2, argv[2]);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = broker_signal;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!broker_stop) {
+	pfd[0].fd = lis;
+	pfd[0].events = POLLIN;
+	for (i = 0; i < ncls; i++) {
+	    pfd[1 + i].fd = cls[i].fd;
+	    pfd[1 + i].events = POLLIN;
+	}
+	if (poll(pfd, 1 + ncls, -1) == -1)
+	    continue;
+
+	/* Last first, so a dropped client's place is already done. */
+	for (i = ncls - 1; i >= 0; i--) {
+	    if (!pfd[1 + i].revents)
+		continue;
+	    if (client_read(&cls[i], &tickets)) {
+		close(cls[i].fd);
+		free(cls[i].data);
+		if (holder == i)
+		    holder = -1;
+		cls[i] = cls[--ncls];
+		if (holder == ncls)
+		    holder = i;
+	    }
+	}
+
+	while ((fd = accept(lis, NULL, NULL)) != -1) {
+	    if (ncls == MAX_CLIENTS) {
+		close(fd);
+		continue;
+	    }
+	    fcntl(fd, F_SETFL, O_NONBLOCK);
+	    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	    memset(&cls[ncls], 0, sizeof(cls[ncls]));
+	    cls[ncls++].fd = fd;
+	}
+
+	/* Strictly first come first served, even if the first is slow. */
+	while (holder == -1) {
+	    for (next = -1, i = 0; i < ncls; i++)
+		if (cls[i].data
+		    && (next == -1 || cls[i].ticket < cls[next].ticket))
+		    next = i;
+	    if (next == -1 || cls[next].got < cls[next].len)
+		break;
+	    for (off = 0; off < cls[next].len; off += n)
+		if ((n = write(logfd, cls[next].data + off, cls[next].len - off)) <= 0) {
+		    syserr(0, argc == 3 ? argv[2] : "stdout");
+		    break;
+		}
+	    free(cls[next].data);
+	    cls[next].data = NULL;
+	    if (write(cls[next].fd, "G", 1) == 1) {
+		holder = next;
+	    } else {
+		close(cls[next].fd);
+		cls[next] = cls[--ncls];
+	    }
+	}
+    }
+    if (is_absolute(argv[1]))
+	unlink(argv[1]);
+
+    return 0;
+}
+
+
+/* Keep this build's warning fingerprints for the next (see SYNCSH_DIAGS). */
+static int
+diags_main(int argc, char *argv[])
+{
+    int n;
+
+    if (argc != 3 || strcmp(argv[1], "save"))
+	usage();
+    syncsh_progname(prog);
+    if ((n = syncsh_diags_save(argv[2])) == -1)
+	syserr(2, argv[2]);
+    printf("%s: %d warning fingerprints saved in %s\n", prog, n, argv[2]);
+
+    return 0;
+}
+
+/*
+ * "syncsh scan <file>": count the lines of a file, and those with
+ * escape sequences or bytes needing quotes, the way output is scanned
+ * (see syncsh_scan_lines()), and time the scan over at least a second.
+ */
+static int
+scan_main(int argc, char *argv[])
+{
+    char *buf = NULL;
+    struct syncsh_line line[256];
+    size_t len = 0, size = 0, i, k, n;
+    long long lines, esc, quote, bytes = 0;
+    int64_t t0, t;
+    ssize_t got;
+    int fd;
+
+    if (argc != 2)
+	usage();
+    if ((fd = open(argv[1], O_RDONLY)) == -1)
+	syserr(2, argv[1]);
+    for (;;) {
+	if (len == size && !(buf = realloc(buf, size = size ? 2 * size : 1 << 20)))
+	    syserr(2, "realloc");
+	if ((got = read(fd, buf + len, size - len)) <= 0)
+	    break;
+	len += got;
+    }
+    if (got == -1)
+	syserr(2, argv[1]);
+    close(fd);
+
+    t0 = syncsh_now_us();
+    do {
+	lines = esc = quote = 0;
+	for (i = 0; i < len;) {
+	    n = syncsh_scan_lines(buf + i, len - i, line, 256);
+	    lines += n;
+	    for (k = 0; k < n; k++) {
+		i += line[k].len;
+		esc += !!(line[k].flags & SYNCSH_SCAN_ESC);
+		quote += !!(line[k].flags & SYNCSH_SCAN_QUOTE);
+	    }
+	}
+	bytes += len;
+    } while ((t = syncsh_now_us() - t0) < 1000000 && len);
+    printf("%-8s %lld lines, %lld with escapes, %lld needing quotes, %.2f GB/s\n",
+	   syncsh_scan_kernel(), lines, esc, quote, bytes / (t * 1e3));
+    free(buf);
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    syncsh_job_t *job;
+    char *sh;
+    char *verbose = NULL;
+    char *shargv[4];
+    int rc;
+
+    prog = basename(argv[0]);
+
+    if (argc <= 1 || !strcmp(argv[1], "-h") || strstr(argv[1], "help")) {
+	usage();
+    }
+
+    if (!strcmp(argv[1], "metrics"))
+	return metrics_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "report"))
+	return report_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "log"))
+	return log_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "broker"))
+	return broker_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "events"))
+	return events_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "lockd"))
+	return lockd_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "diags"))
+	return diags_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "scan"))
+	return scan_main(argc - 1, argv + 1);
+
+    verbose = getenv(PFX "VERBOSE");
+
+    if (!(sh = getenv(PFX "SHELL")))
+	sh = "/bin/sh";
+
+    /*
+     * A $(shell ...) call may be answered from the build's memo table.
+     * In a sub-make these carry MAKELEVEL too, so the library checks
+     * where the call came from.
+     */
+    if (argc == 3 && getenv(PFX "MEMO") && argv[1][0] == '-'
+	&& strchr(argv[1], 'c') && argv[2][0] != '-') {
+	syncsh_progname(prog);
+	if ((rc = syncsh_memo(sh, argv[1], argv[2])) >= 0)
+	    return rc;
+    }
+
+    /*
+     * Here it looks like the shell is not being used to run a recipe.y
+     * E.g. the makefile may contain a literal "$(SHELL) foobar.sh ..."
+     * within a recipe or in some function such as $(shell foobar.sh).
+     * Since we're not running a recipe we don't need to worry about
+     * synchronizing with other recipes.
+     * Special case of the above: if MAKELEVEL is not present at all,
+     * that means we're (a) in a top-level (non-recursive) make process
+     * and (b) we're not running a recipe, since MAKELEVEL is incremented
+     * and exported for each recipe.
+     */
+    if (argc != 3 || argv[1][0] != '-' || !strchr(argv[1], 'c')
+	|| argv[2][0] == '-' || !getenv("MAKELEVEL")) {
+	argv[0] = sh;
+	if (verbose) {
+	    fflush(stderr);
+	    vb(fileno(stderr), verbose, argv);
+	}
+	execvp(argv[0], argv);
+	syserr(2, argv[0]);
+    }
+
+    shargv[0] = sh;
+    shargv[1] = argv[1];
+    shargv[2] = argv[2];
+    shargv[3] = NULL;
+
+    syncsh_progname(prog);
+    if (!(job = syncsh_begin(argv[2], sh, SYNCSH_OWN_PROCESS)))
+	return 2;
+
+    if (!syncsh_replayed(job)) {
+	if (verbose)
+	    vb(syncsh_fd(job, 2), verbose, shargv + 2);
+	if (syncsh_spawn(job, shargv) == -1) {
+	    syncsh_end(job);
+	    return 2;
+	}
+    }
+    syncsh_finish(job, 0);
+    if (syncsh_publish(job) == -1) {
+	syncsh_end(job);
+	return 2;
+    }
 
-    return status >> 8;
+    return syncsh_end(job);
 }